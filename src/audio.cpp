@@ -1,194 +1,293 @@
 // The gameboy audio chip is called APU(audio processing unit)
 // This runs off of the same master clock as the PPU and CPU perfectly in sync.
 // a “256 Hz tick” means “1 ∕ 256th of a second”
-#include <cstdint>
+#pragma once
 
-class Channel1 {
+#include "spsc_ring.cpp"
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// =============================================================
+// BlipBuffer: band-limited step synthesis
+// Amplitude changes are recorded at their exact clock time and
+// spread over the output samples through a precomputed windowed
+// sinc kernel, so edges between samples don't alias.
+// =============================================================
+class BlipBuffer {
 public:
-  uint8_t nr10;
-  uint8_t nr11;
-  uint8_t nr12;
-  uint8_t nr13;
-  uint8_t nr14;
-
-  bool enabled;
+  static constexpr int PHASE_BITS = 5;
+  static constexpr int PHASES = 1 << PHASE_BITS; // Sub-sample positions
+  static constexpr int TAPS = 16;                // Kernel width in samples
+  static constexpr int FRAC_BITS = 24;           // Fixed point sample time
+  static constexpr int KERNEL_UNIT = 1 << 15;    // Each kernel row sums to it
+  static constexpr std::size_t CAPACITY = 8192;  // Samples held between reads
+
+  BlipBuffer() {
+    factor = 0;
+    offset = 0;
+    integrator = 0;
+    std::memset(buffer, 0, sizeof(buffer));
+  }
 
-  int frequency_timer;
-  int wave_position;
+  void set_rates(double clock_rate, double sample_rate) {
+    factor = static_cast<uint64_t>(sample_rate / clock_rate *
+                                       (uint64_t(1) << FRAC_BITS) +
+                                   0.5);
+  }
 
-  int length_timer;
+  // Clock cycles needed (from the start of the current frame) until
+  // `samples` samples are ready to read.
+  uint32_t clocks_needed(std::size_t samples) const {
+    uint64_t target = uint64_t(samples) << FRAC_BITS;
+    if (target <= offset)
+      return 0;
+    return static_cast<uint32_t>((target - offset + factor - 1) / factor);
+  }
 
-  int envelope_timer;
-  int current_volume;
+  // `time` is in clock cycles relative to the start of the current frame.
+  void add_delta(uint32_t time, int delta) {
+    if (delta == 0)
+      return;
+    uint64_t pos = offset + time * factor;
+    std::size_t index = pos >> FRAC_BITS;
+    int phase = (pos >> (FRAC_BITS - PHASE_BITS)) & (PHASES - 1);
+    if (index + TAPS > CAPACITY)
+      return; // Caller ran too far ahead of read_samples()
+
+    const int16_t *k = kernel()[phase];
+    int32_t *out = &buffer[index];
+    for (int i = 0; i < TAPS; i++)
+      out[i] += k[i] * delta;
+  }
 
-  int sweep_timer;
-  int shadow_frequency;
-  bool sweep_enabled;
+  // Closes a frame of `duration` clocks; samples before it become readable.
+  void end_frame(uint32_t duration) { offset += duration * factor; }
 
-  const uint8_t wave_patterns[4][8] = {{0, 0, 0, 0, 0, 0, 0, 1},
-                                       {1, 0, 0, 0, 0, 0, 0, 1},
-                                       {1, 0, 0, 0, 0, 1, 1, 1},
-                                       {0, 1, 1, 1, 1, 1, 1, 0}};
+  std::size_t samples_avail() const { return offset >> FRAC_BITS; }
 
-  Channel1() {
-    nr10 = 0;
-    nr11 = 0;
-    nr12 = 0;
-    nr13 = 0;
-    nr14 = 0;
-    enabled = false;
-    frequency_timer = 0;
-    wave_position = 0;
-    length_timer = 0;
-    envelope_timer = 0;
-    current_volume = 0;
-    sweep_timer = 0;
-    shadow_frequency = 0;
-    sweep_enabled = false;
-  }
+  // Writes `count` samples to out[0], out[stride], ... multiplied by `scale`.
+  std::size_t read_samples(float *out, std::size_t count, int stride,
+                           float scale) {
+    if (count > samples_avail())
+      count = samples_avail();
 
-  uint8_t read_byte(uint16_t addr) {
-    switch (addr) {
-    case 0xFF10:
-      return nr10 | 0x80;
-    case 0xFF11:
-      return nr11 | 0x3F;
-    case 0xFF12:
-      return nr12;
-    case 0xFF13:
-      return 0xFF;
-    case 0xFF14:
-      return nr14 | 0xBF;
-    default:
-      return 0xFF;
+    int32_t sum = integrator;
+    float unit = scale / KERNEL_UNIT;
+    for (std::size_t i = 0; i < count; i++) {
+      sum += buffer[i];
+      out[i * stride] = sum * unit;
     }
+    integrator = sum;
+    remove_samples(count);
+    return count;
   }
 
-  void write_byte(uint16_t addr, uint8_t value) {
-    switch (addr) {
-    case 0xFF10:
-      nr10 = value;
-      break;
-    case 0xFF11:
-      nr11 = value;
-      length_timer = 64 - (nr11 & 0x3F);
-      break;
-    case 0xFF12:
-      nr12 = value;
-      break;
-    case 0xFF13:
-      nr13 = value;
-      break;
-    case 0xFF14:
-      nr14 = value;
-      if (value & 0x80) {
-        trigger();
-      }
-      break;
+  // Integer version: samples are multiplied by gain / 2^32 and clamped
+  // to int16, since the kernel can overshoot full scale slightly.
+  std::size_t read_samples(int16_t *out, std::size_t count, int stride,
+                           int64_t gain) {
+    if (count > samples_avail())
+      count = samples_avail();
+
+    int32_t sum = integrator;
+    for (std::size_t i = 0; i < count; i++) {
+      sum += buffer[i];
+      int64_t s = (sum * gain) >> 32;
+      if (s > 32767)
+        s = 32767;
+      if (s < -32768)
+        s = -32768;
+      out[i * stride] = static_cast<int16_t>(s);
     }
+    integrator = sum;
+    remove_samples(count);
+    return count;
   }
 
-  void trigger() {
-    enabled = true;
+private:
+  int32_t buffer[CAPACITY + TAPS];
+  uint64_t factor;     // Output samples per clock, FRAC_BITS fixed point
+  uint64_t offset;     // Start of the current frame, FRAC_BITS fixed point
+  int32_t integrator;  // Running sum of all deltas already read
+
+  void remove_samples(std::size_t count) {
+    std::size_t remain = samples_avail() + TAPS - count;
+    std::memmove(buffer, buffer + count, remain * sizeof(buffer[0]));
+    std::memset(buffer + remain, 0, count * sizeof(buffer[0]));
+    offset -= uint64_t(count) << FRAC_BITS;
+  }
 
-    if (length_timer == 0) {
-      length_timer = 64;
-    }
+  // Blackman windowed sinc, cut off a little below Nyquist. Rounding
+  // error goes into the centre tap so every phase has exactly unit DC
+  // gain and the integrator never drifts.
+  static const int16_t (*kernel())[TAPS] {
+    struct Table {
+      int16_t rows[PHASES][TAPS];
+
+      Table() {
+        const double pi = 3.14159265358979323846;
+        const double cutoff = 0.9;
+        for (int p = 0; p < PHASES; p++) {
+          double taps[TAPS];
+          double total = 0.0;
+          for (int i = 0; i < TAPS; i++) {
+            double t = i - (TAPS / 2 - 1) - double(p) / PHASES;
+            double x = pi * cutoff * t;
+            double sinc = (t == 0.0) ? 1.0 : std::sin(x) / x;
+            double w = (t + TAPS / 2) / TAPS;
+            double window = 0.42 - 0.5 * std::cos(2 * pi * w) +
+                            0.08 * std::cos(4 * pi * w);
+            taps[i] = sinc * window;
+            total += taps[i];
+          }
+          int sum = 0;
+          for (int i = 0; i < TAPS; i++) {
+            rows[p][i] = static_cast<int16_t>(
+                std::lround(taps[i] / total * KERNEL_UNIT));
+            sum += rows[p][i];
+          }
+          rows[p][TAPS / 2 - 1] += KERNEL_UNIT - sum;
+        }
+      }
+    };
+    static const Table table;
+    return table.rows;
+  }
+};
 
-    frequency_timer = (2048 - get_frequency()) * 4;
+// =============================================================
+// Components shared by the channels
+// =============================================================
 
-    envelope_timer = nr12 & 0x07;
-    current_volume = (nr12 >> 4) & 0x0F;
+// Volume envelope (NRx2) of the pulse and noise channels, stepped at 64Hz
+struct Envelope {
+  uint8_t timer = 0;
+  uint8_t volume = 0;
 
-    shadow_frequency = get_frequency();
-    int sweep_period = (nr10 >> 4) & 0x07;
-    int sweep_shift = nr10 & 0x07;
+  void trigger(uint8_t nrx2) {
+    timer = nrx2 & 0x07;
+    volume = (nrx2 >> 4) & 0x0F;
+  }
 
-    sweep_timer = sweep_period;
-    if (sweep_period == 0) {
-      sweep_timer = 8;
+  void step(uint8_t nrx2) {
+    if (timer == 0)
+      return;
+    timer--;
+    if (timer == 0) {
+      timer = nrx2 & 0x07;
+      if (timer != 0) {
+        if ((nrx2 & 0x08) && volume < 15)
+          volume++;
+        else if (!(nrx2 & 0x08) && volume > 0)
+          volume--;
+      }
     }
-
-    sweep_enabled = (sweep_period > 0) || (sweep_shift > 0);
   }
+};
 
-  uint16_t get_frequency() { return nr13 | ((nr14 & 0x07) << 8); }
+// Length counter, stepped at 256Hz. Max is 64, or 256 for the wave channel
+template <int Max> struct LengthCounter {
+  uint16_t timer = 0;
 
-  uint8_t get_output() {
-    if (!enabled)
-      return 0;
+  void load(uint8_t length) { timer = Max - length; }
 
-    uint8_t duty_index = (nr11 >> 6) & 0x03;
-    uint8_t wave_output = wave_patterns[duty_index][wave_position];
+  void trigger() {
+    if (timer == 0)
+      timer = Max;
+  }
 
-    return wave_output * current_volume;
+  // True when the counter runs out and the channel has to stop
+  bool step(uint8_t nrx4) {
+    if (!(nrx4 & 0x40) || timer == 0)
+      return false;
+    timer--;
+    return timer == 0;
   }
 };
-class Channel2 {
-public:
-  uint8_t nr21;
-  uint8_t nr22;
-  uint8_t nr23;
-  uint8_t nr24;
-
-  bool enabled;
-  int frequency_timer;
-  int wave_position;
 
-  int length_timer;
+// Frequency sweep state (NR10), only channel 1 has it
+struct PulseSweep {
+  uint8_t nrx0 = 0;
+  uint8_t sweep_timer = 0;
+  bool sweep_enabled = false;
+  uint16_t shadow_frequency = 0;
+};
 
-  int envelope_timer;
-  int current_volume;
+struct NoSweep {};
 
-  const uint8_t wave_patterns[4][8] = {
-      {0, 0, 0, 0, 0, 0, 0, 1}, // 12.5%
-      {1, 0, 0, 0, 0, 0, 0, 1}, // 25%
-      {1, 0, 0, 0, 0, 1, 1, 1}, // 50%
-      {0, 1, 1, 1, 1, 1, 1, 0}  // 75%
+// =============================================================
+// Pulse channels: Channel1 (with sweep) and Channel2
+// =============================================================
+template <bool HasSweep>
+class PulseChannel
+    : public std::conditional_t<HasSweep, PulseSweep, NoSweep> {
+public:
+  static constexpr uint16_t BASE = HasSweep ? 0xFF10 : 0xFF15; // NRx0
+
+  // Duty waveforms, bit n is the output at wave_position n
+  static constexpr uint8_t DUTY_MASKS[4] = {
+      0x80, // 12.5%
+      0x81, // 25%
+      0xE1, // 50%
+      0x7E  // 75%
   };
 
-  Channel2() {
-    nr21 = 0;
-    nr22 = 0;
-    nr23 = 0;
-    nr24 = 0;
-    enabled = false;
-    frequency_timer = 0;
-    wave_position = 0;
-    length_timer = 0;
-    envelope_timer = 0;
-    current_volume = 0;
-  }
+  uint8_t nrx1 = 0;
+  uint8_t nrx2 = 0;
+  uint8_t nrx3 = 0;
+  uint8_t nrx4 = 0;
+
+  bool enabled = false;
+  uint8_t wave_position = 0;
+  Envelope envelope;
+  LengthCounter<64> length;
+  int frequency_timer = 0;
 
   uint8_t read_byte(uint16_t addr) {
-    switch (addr) {
-    case 0xFF16:
-      return nr21 | 0x3F; // Mask out length data (Write Only)
-    case 0xFF17:
-      return nr22;
-    case 0xFF18:
+    switch (addr - BASE) {
+    case 0:
+      if constexpr (HasSweep)
+        return this->nrx0 | 0x80;
+      return 0xFF;
+    case 1:
+      return nrx1 | 0x3F; // Mask out length data (Write Only)
+    case 2:
+      return nrx2;
+    case 3:
       return 0xFF; // Write Only
-    case 0xFF19:
-      return nr24 | 0xBF; // Mask out Trigger bit
+    case 4:
+      return nrx4 | 0xBF; // Mask out Trigger bit
     default:
       return 0xFF;
     }
   }
 
   void write_byte(uint16_t addr, uint8_t value) {
-    switch (addr) {
-    case 0xFF16:
-      nr21 = value;
-      length_timer = 64 - (nr21 & 0x3F);
+    switch (addr - BASE) {
+    case 0:
+      if constexpr (HasSweep)
+        this->nrx0 = value;
+      break;
+    case 1:
+      nrx1 = value;
+      length.load(nrx1 & 0x3F);
       break;
-    case 0xFF17:
-      nr22 = value;
+    case 2:
+      nrx2 = value;
       break;
-    case 0xFF18:
-      nr23 = value;
+    case 3:
+      nrx3 = value;
       break;
-    case 0xFF19:
-      nr24 = value;
+    case 4:
+      nrx4 = value;
       if (value & 0x80) {
         trigger();
       }
@@ -198,30 +297,89 @@ public:
 
   void trigger() {
     enabled = true;
+    length.trigger();
+    frequency_timer = period();
+    envelope.trigger(nrx2);
+
+    if constexpr (HasSweep) {
+      this->shadow_frequency = get_frequency();
+      int sweep_period = (this->nrx0 >> 4) & 0x07;
+      int sweep_shift = this->nrx0 & 0x07;
+
+      this->sweep_timer = sweep_period;
+      if (sweep_period == 0) {
+        this->sweep_timer = 8;
+      }
+
+      this->sweep_enabled = (sweep_period > 0) || (sweep_shift > 0);
+    }
+  }
 
-    if (length_timer == 0) {
-      length_timer = 64;
+  void step_sweep() {
+    if constexpr (HasSweep) {
+      if (!this->sweep_enabled || this->sweep_timer == 0)
+        return;
+      this->sweep_timer--;
+      if (this->sweep_timer != 0)
+        return;
+
+      int period = (this->nrx0 >> 4) & 0x07;
+      this->sweep_timer = (period == 0) ? 8 : period;
+      if (period == 0)
+        return;
+
+      int shift = this->nrx0 & 0x07;
+      int delta = this->shadow_frequency >> shift;
+      int new_freq = this->shadow_frequency;
+
+      if (this->nrx0 & 0x08)
+        new_freq -= delta; // Subtraction
+      else
+        new_freq += delta; // Addition
+
+      if (new_freq > 2047) {
+        enabled = false;
+      } else if (new_freq >= 0) {
+        this->shadow_frequency = new_freq;
+        nrx3 = new_freq & 0xFF;
+        nrx4 = (nrx4 & 0xF8) | ((new_freq >> 8) & 0x07);
+      }
     }
+  }
 
-    frequency_timer = (2048 - get_frequency()) * 4;
+  uint16_t get_frequency() { return nrx3 | ((nrx4 & 0x07) << 8); }
 
-    envelope_timer = nr22 & 0x07;
-    current_volume = (nr22 >> 4) & 0x0F;
+  int period() { return (2048 - get_frequency()) * 4; }
+
+  // One duty step, taken when the frequency timer runs out
+  void clock() {
+    wave_position = (wave_position + 1) & 7;
+    frequency_timer = period();
   }
 
-  uint16_t get_frequency() { return nr23 | ((nr24 & 0x07) << 8); }
+  // Advances `cycles` without observing the steps in between
+  void skip(int cycles) {
+    if (cycles < frequency_timer) {
+      frequency_timer -= cycles;
+      return;
+    }
+    cycles -= frequency_timer;
+    int p = period();
+    wave_position = (wave_position + 1 + cycles / p) & 7;
+    frequency_timer = p - cycles % p;
+  }
 
   uint8_t get_output() {
     if (!enabled)
       return 0;
-
-    uint8_t duty_index = (nr21 >> 6) & 0x03;
-    uint8_t wave_output = wave_patterns[duty_index][wave_position];
-
-    return wave_output * current_volume;
+    return ((DUTY_MASKS[nrx1 >> 6] >> wave_position) & 1) ? envelope.volume
+                                                           : 0;
   }
 };
 
+using Channel1 = PulseChannel<true>;
+using Channel2 = PulseChannel<false>;
+
 class Channel3 {
 public:
   uint8_t nr30;
@@ -235,9 +393,9 @@ public:
   bool enabled;
   bool dac_enabled;
 
+  uint8_t wave_position;
+  LengthCounter<256> length;
   int frequency_timer;
-  int wave_position;
-  int length_timer;
 
   Channel3() {
     nr30 = 0;
@@ -252,7 +410,6 @@ public:
     dac_enabled = false;
     frequency_timer = 0;
     wave_position = 0;
-    length_timer = 0;
   }
 
   uint8_t read_byte(uint16_t addr) {
@@ -282,7 +439,7 @@ public:
       break;
     case 0xFF1B:
       nr31 = value;
-      length_timer = 256 - nr31;
+      length.load(nr31);
       break;
     case 0xFF1C:
       nr32 = value;
@@ -310,16 +467,32 @@ public:
       enabled = true;
     }
 
-    if (length_timer == 0) {
-      length_timer = 256;
-    }
+    length.trigger();
 
     wave_position = 0;
-    frequency_timer = (2048 - get_frequency()) * 2;
+    frequency_timer = period();
   }
 
   uint16_t get_frequency() { return nr33 | ((nr34 & 0x07) << 8); }
 
+  int period() { return (2048 - get_frequency()) * 2; }
+
+  void clock() {
+    wave_position = (wave_position + 1) & 31;
+    frequency_timer = period();
+  }
+
+  void skip(int cycles) {
+    if (cycles < frequency_timer) {
+      frequency_timer -= cycles;
+      return;
+    }
+    cycles -= frequency_timer;
+    int p = period();
+    wave_position = (wave_position + 1 + cycles / p) & 31;
+    frequency_timer = p - cycles % p;
+  }
+
   uint8_t get_output() {
     if (!enabled || !dac_enabled)
       return 0;
@@ -350,6 +523,72 @@ public:
   }
 };
 
+// =============================================================
+// Noise channel LFSR sequences
+// In 15-bit mode every non-zero register value lies on one 32767 step
+// cycle. In 7-bit mode the low 7 bits run through a 127 step cycle of
+// their own, and the bits above them are fixed by the last 8 steps.
+// Tracking a position on these cycles lets the channel jump any number
+// of steps and count its high outputs in O(1). Switching to 7-bit mode
+// with the low 7 bits all zero locks the LFSR up, as on hardware.
+// =============================================================
+struct LfsrTables {
+  static constexpr int PERIOD15 = 32767;
+  static constexpr int PERIOD7 = 127;
+  static constexpr uint16_t LOCKED = 0xFFFF; // Position of a stuck LFSR
+
+  uint16_t state15[PERIOD15];     // Register value at each position
+  uint16_t index15[0x8000];       // Position of each register value
+  uint16_t high15[PERIOD15 + 1];  // Positions before i with output high
+  uint16_t state7[PERIOD7];       // Register value once 8+ steps in
+  uint8_t index7[0x80];           // Position of each low 7 bit value
+  uint16_t high7[PERIOD7 + 1];
+
+  static uint16_t next(uint16_t lfsr, bool narrow) {
+    uint16_t xor_res = (lfsr & 0x01) ^ ((lfsr >> 1) & 0x01);
+
+    lfsr >>= 1;
+
+    lfsr |= (xor_res << 14);
+
+    if (narrow) {
+      lfsr &= ~(1 << 6);      // Clear bit 6
+      lfsr |= (xor_res << 6); // Set bit 6
+    }
+    return lfsr;
+  }
+
+  LfsrTables() {
+    uint16_t lfsr = 0x7FFF;
+    high15[0] = 0;
+    for (int i = 0; i < PERIOD15; i++) {
+      state15[i] = lfsr;
+      index15[lfsr] = i;
+      high15[i + 1] = high15[i] + (~lfsr & 1);
+      lfsr = next(lfsr, false);
+    }
+    index15[0] = 0; // Unreachable
+
+    // One full period first so the upper bits have settled
+    lfsr = 0x7FFF;
+    for (int i = 0; i < PERIOD7; i++)
+      lfsr = next(lfsr, true);
+    high7[0] = 0;
+    for (int i = 0; i < PERIOD7; i++) {
+      state7[i] = lfsr;
+      index7[lfsr & 0x7F] = i;
+      high7[i + 1] = high7[i] + (~lfsr & 1);
+      lfsr = next(lfsr, true);
+    }
+    index7[0] = 0; // Unreachable
+  }
+
+  static const LfsrTables &get() {
+    static const LfsrTables tables;
+    return tables;
+  }
+};
+
 class Channel4 {
 public:
   uint8_t nr41;
@@ -359,12 +598,21 @@ public:
 
   bool enabled;
 
-  uint16_t lfsr; // The Linear Feedback Shift Register
+  // The Linear Feedback Shift Register, kept as a position on its cycle
+  // (see LfsrTables). `lfsr` is the register value the current run
+  // started from (trigger or NR43 write).
+  uint16_t lfsr;
+  uint16_t lfsr_pos;
+  uint8_t lfsr_fresh; // Steps into the run, saturating at 8
 
+  Envelope envelope;
+  LengthCounter<64> length;
   int frequency_timer;
-  int length_timer;
-  int envelope_timer;
-  int current_volume;
+  int divisor; // get_divisor(), cached when NR43 is written
+
+  // Steps skipped since take_average(), and how many of them were high
+  uint32_t skipped_steps;
+  uint32_t skipped_high;
 
   Channel4() {
     nr41 = 0;
@@ -372,11 +620,11 @@ public:
     nr43 = 0;
     nr44 = 0;
     enabled = false;
-    lfsr = 0x7FFF; // Initial seed (must not be 0)
+    start_run(0x7FFF); // Initial seed (must not be 0)
     frequency_timer = 0;
-    length_timer = 0;
-    envelope_timer = 0;
-    current_volume = 0;
+    divisor = get_divisor();
+    skipped_steps = 0;
+    skipped_high = 0;
   }
 
   uint8_t read_byte(uint16_t addr) {
@@ -398,14 +646,19 @@ public:
     switch (addr) {
     case 0xFF20:
       nr41 = value;
-      length_timer = 64 - (nr41 & 0x3F);
+      length.load(nr41 & 0x3F);
       break;
     case 0xFF21:
       nr42 = value;
       break;
-    case 0xFF22:
+    case 0xFF22: {
+      // The width bit picks the cycle, so restart from the current value
+      uint16_t current = get_lfsr();
       nr43 = value;
+      divisor = get_divisor();
+      start_run(current);
       break;
+    }
     case 0xFF23:
       nr44 = value;
       if (value & 0x80) {
@@ -417,17 +670,17 @@ public:
 
   void trigger() {
     enabled = true;
-    lfsr = 0x7FFF; // Reset LFSR to all 1s
+    start_run(0x7FFF); // Reset LFSR to all 1s
+    skipped_steps = 0;
+    skipped_high = 0;
 
-    if (length_timer == 0) {
-      length_timer = 64;
-    }
-
-    envelope_timer = nr42 & 0x07;
-    current_volume = (nr42 >> 4) & 0x0F;
-    frequency_timer = get_divisor();
+    length.trigger();
+    envelope.trigger(nr42);
+    frequency_timer = period();
   }
 
+  int period() { return divisor; }
+
   int get_divisor() {
     int r = nr43 & 0x07;
     int s = (nr43 >> 4) & 0x0F;
@@ -436,26 +689,126 @@ public:
     return base_divisor << s; // 2^s shift
   }
 
+  bool is_narrow() const { return (nr43 & 0x08) != 0; }
+
+  uint16_t get_lfsr() const {
+    const LfsrTables &t = LfsrTables::get();
+    if (lfsr_pos == LfsrTables::LOCKED) {
+      if (lfsr_fresh >= 8)
+        return 0; // Only zeros get shifted in
+    } else if (!is_narrow()) {
+      return t.state15[lfsr_pos];
+    } else if (lfsr_fresh >= 8) {
+      return t.state7[lfsr_pos];
+    }
+    uint16_t value = lfsr;
+    for (int i = 0; i < lfsr_fresh; i++)
+      value = LfsrTables::next(value, true);
+    return value;
+  }
+
+  void start_run(uint16_t value) {
+    const LfsrTables &t = LfsrTables::get();
+    lfsr = value;
+    if (is_narrow())
+      lfsr_pos = (value & 0x7F) ? t.index7[value & 0x7F] : LfsrTables::LOCKED;
+    else
+      lfsr_pos = value ? t.index15[value] : LfsrTables::LOCKED;
+    lfsr_fresh = 0;
+  }
+
   uint8_t get_output() {
     if (!enabled)
       return 0;
 
-    return (~lfsr & 1) ? current_volume : 0;
+    if (lfsr_pos == LfsrTables::LOCKED)
+      return envelope.volume; // Bit 0 stuck at zero
+
+    const LfsrTables &t = LfsrTables::get();
+    uint16_t value = is_narrow() ? t.state7[lfsr_pos] : t.state15[lfsr_pos];
+    return (~value & 1) ? envelope.volume : 0;
   }
 
-  void step_lfsr() {
-    uint16_t xor_res = (lfsr & 0x01) ^ ((lfsr >> 1) & 0x01);
+  // Moves `steps` along the cycle, counting the high outputs passed
+  void step_lfsr(uint32_t steps = 1) {
+    if (lfsr_fresh < 8)
+      lfsr_fresh = (steps < 8u - lfsr_fresh) ? lfsr_fresh + steps : 8;
+    skipped_steps += steps;
+    if (lfsr_pos == LfsrTables::LOCKED) {
+      skipped_high += steps;
+      return;
+    }
 
-    lfsr >>= 1;
+    const LfsrTables &t = LfsrTables::get();
+    bool narrow = is_narrow();
+    uint32_t cycle = narrow ? LfsrTables::PERIOD7 : LfsrTables::PERIOD15;
+    const uint16_t *high = narrow ? t.high7 : t.high15;
+
+    // Outputs at positions lfsr_pos+1 .. lfsr_pos+steps
+    uint32_t start = lfsr_pos + 1;
+    if (start == cycle)
+      start = 0;
+    uint32_t count = (steps / cycle) * high[cycle];
+    uint32_t end = start + steps % cycle;
+    if (end <= cycle)
+      count += high[end] - high[start];
+    else
+      count += high[cycle] - high[start] + high[end - cycle];
+
+    skipped_high += count;
+    lfsr_pos = (lfsr_pos + steps % cycle) % cycle;
+  }
 
-    lfsr |= (xor_res << 14);
+  // Mean output level (0-15) over the steps taken since the last call,
+  // or the current output if the LFSR hasn't moved. Used to render noise
+  // clocked faster than the output rate at O(1) cost per sample.
+  float take_average() {
+    float level;
+    if (skipped_steps == 0)
+      level = get_output();
+    else if (!enabled)
+      level = 0.0f;
+    else
+      level = float(envelope.volume) * skipped_high / skipped_steps;
+    skipped_steps = 0;
+    skipped_high = 0;
+    return level;
+  }
 
-    if (nr43 & 0x08) {
-      lfsr &= ~(1 << 6);      // Clear bit 6
-      lfsr |= (xor_res << 6); // Set bit 6
-    }
+  // take_average() in 1/unit steps, rounded, without touching floats
+  int take_average(int unit) {
+    int level;
+    if (skipped_steps == 0)
+      level = get_output() * unit;
+    else if (!enabled)
+      level = 0;
+    else
+      level = static_cast<int>(
+          (uint64_t(envelope.volume) * unit * skipped_high +
+           skipped_steps / 2) /
+          skipped_steps);
+    skipped_steps = 0;
+    skipped_high = 0;
+    return level;
+  }
+
+  void clock() {
+    step_lfsr();
+    frequency_timer = period();
+  }
 
-    frequency_timer = get_divisor();
+  void skip(int cycles) {
+    if (cycles < frequency_timer) {
+      frequency_timer -= cycles;
+      return;
+    }
+    cycles -= frequency_timer;
+    int p = period();
+    int steps = 1 + cycles / p;
+    frequency_timer = p - cycles % p;
+    // A disabled channel is silent and trigger() reseeds the LFSR
+    if (enabled)
+      step_lfsr(steps);
   }
 };
 
@@ -473,6 +826,69 @@ public:
   int frame_sequencer;
   int frame_timer; // Counts CPU cycles to reach 512Hz
 
+  static constexpr int CLOCK_RATE = 4194304;
+  static constexpr std::size_t RENDER_BLOCK = 256; // Frames mixed at once
+
+  int cycles_per_sample; // Point sampling step, see set_sample_rate()
+
+  // NR50/NR51 folded into one gain per side and channel. Recomputed on
+  // register writes so the mixers never decode the registers themselves.
+  int mix_level[2][4];  // Pan bit times master volume (0-8)
+  float mix_gain[2][4]; // mix_level scaled so full output is 1.0
+  int16_t mix_gain_s16[2][4]; // Same for render_s16(), see MIX_S16_SHIFT
+
+  // Integer output: channel levels in 1/BLEP_UNIT steps times
+  // mix_gain_s16, shifted right by this, give full scale at 32767.
+  static constexpr int MIX_S16_SHIFT = 7;
+
+  // Band-limited synthesis mode: every output change is recorded at its
+  // exact cycle instead of point sampling the channels once per sample.
+  static constexpr int BLEP_UNIT = 16; // Fractional levels per output step
+  bool blep_enabled;
+  BlipBuffer blep_left;
+  BlipBuffer blep_right;
+  uint32_t blep_time;   // Cycles since the current blip frame started
+  int blep_level[2][4]; // Last amplitude sent per side and channel
+  int blep_noise_chunk; // Cycles per output sample
+  int blep_noise_timer; // Cycles until the next averaged noise level
+
+  // Register writes from other threads. They are stamped with the
+  // emulated cycle they belong to and applied by the thread that runs
+  // tick(), exactly at that cycle.
+  struct RegisterWrite {
+    uint64_t cycle;
+    uint16_t addr;
+    uint8_t value;
+  };
+  SpscRing<RegisterWrite, 1024> write_queue;
+  uint64_t cycle_counter;                // Total cycles run by tick()
+  std::atomic<uint64_t> published_cycle; // cycle_counter for other threads
+
+  // Something that makes register writes on its own schedule from inside
+  // tick(), like a music sequencer. tick() stops at next_cycle and calls
+  // run(), which writes to the APU and moves next_cycle on.
+  struct EventSource {
+    uint64_t next_cycle = UINT64_MAX;
+    virtual void run(APU &apu) = 0; // Must move next_cycle past now
+    virtual ~EventSource() = default;
+  };
+  EventSource *event_source; // Set only while tick() isn't running
+
+  // Oscilloscope tap for visualizers. While scope_enabled is set, tick()
+  // pushes every channel's level and the mixed output every SCOPE_PERIOD
+  // cycles; a reader on another thread pops them. Frames are dropped when
+  // the reader falls behind, and with the tap off the only cost is one
+  // flag load per tick().
+  struct ScopeFrame {
+    uint8_t channel[4]; // Output level, 0-15
+    int16_t left;       // Mixed like render_s16()
+    int16_t right;
+  };
+  static constexpr int SCOPE_PERIOD = 128; // 32768 frames per second
+  SpscRing<ScopeFrame, 4096> scope;
+  std::atomic<bool> scope_enabled;
+  uint64_t scope_next; // Cycle of the next frame
+
   struct StereoSample {
     float left;
     float right;
@@ -484,40 +900,266 @@ public:
     nr52 = 0;
     frame_sequencer = 0;
     frame_timer = 0;
+    cycles_per_sample = CLOCK_RATE / 44100;
+    update_mix();
+    blep_enabled = false;
+    blep_time = 0;
+    blep_noise_chunk = 1;
+    blep_noise_timer = 1;
+    std::memset(blep_level, 0, sizeof(blep_level));
+    cycle_counter = 0;
+    published_cycle = 0;
+    event_source = nullptr;
+    scope_enabled = false;
+    scope_next = 0;
+  }
+
+  void set_sample_rate(int sample_rate) {
+    cycles_per_sample = CLOCK_RATE / sample_rate;
+  }
+
+  void update_mix() {
+    int vol_left = ((nr50 >> 4) & 0x07) + 1;
+    int vol_right = (nr50 & 0x07) + 1;
+    for (int channel = 0; channel < 4; channel++) {
+      mix_level[0][channel] = (nr51 & (0x10 << channel)) ? vol_left : 0;
+      mix_level[1][channel] = (nr51 & (0x01 << channel)) ? vol_right : 0;
+      mix_gain[0][channel] = mix_level[0][channel] / 480.0f;
+      mix_gain[1][channel] = mix_level[1][channel] / 480.0f;
+      for (int side = 0; side < 2; side++)
+        mix_gain_s16[side][channel] = static_cast<int16_t>(
+            (mix_level[side][channel] * (32767 << MIX_S16_SHIFT) + 3840) /
+            (480 * BLEP_UNIT));
+    }
+  }
+
+  void enable_blep(int sample_rate) {
+    blep_enabled = true;
+    blep_left.set_rates(CLOCK_RATE, sample_rate);
+    blep_right.set_rates(CLOCK_RATE, sample_rate);
+    blep_noise_chunk = CLOCK_RATE / sample_rate;
+    if (blep_noise_chunk < 1)
+      blep_noise_chunk = 1;
+    blep_noise_timer = blep_noise_chunk;
+  }
+
+  // Producer side of write_queue. Writes must be posted in cycle order;
+  // ones stamped in the past are applied at the start of the next tick().
+  // Returns false if the queue is full and the write was dropped.
+  bool post_write(uint64_t cycle, uint16_t addr, uint8_t value) {
+    return write_queue.push({cycle, addr, value});
+  }
+
+  // Last cycle reached by the thread running tick(), safe to read anywhere
+  uint64_t current_cycle() const {
+    return published_cycle.load(std::memory_order_acquire);
   }
 
+  // Samples render() can make without passing `cycle`, and at least one.
+  // A producer with more writes than the queue holds renders this far,
+  // so the write that didn't fit is posted before its cycle comes.
+  std::size_t samples_until(uint64_t cycle) const {
+    uint64_t now = current_cycle();
+    uint64_t samples = cycle > now ? (cycle - now) / cycles_per_sample : 0;
+    return samples ? std::size_t(samples) : 1;
+  }
+
+  // Runs the APU forward by `cpu_cycles`, stopping at the cycle of each
+  // queued register write and event_source event to apply it.
   void tick(int cpu_cycles) {
-    if (!(nr52 & 0x80))
+    bool scope_on = scope_enabled.load(std::memory_order_relaxed);
+    if (scope_on && scope_next < cycle_counter)
+      scope_next = cycle_counter; // Tap was off, start from now
+    while (cpu_cycles > 0) {
+      int span = cpu_cycles;
+      if (const RegisterWrite *w = write_queue.peek()) {
+        if (w->cycle <= cycle_counter) {
+          write_byte(w->addr, w->value);
+          write_queue.pop();
+          continue;
+        }
+        if (w->cycle - cycle_counter < uint64_t(span))
+          span = static_cast<int>(w->cycle - cycle_counter);
+      }
+      if (event_source) {
+        uint64_t next = event_source->next_cycle;
+        if (next <= cycle_counter) {
+          event_source->run(*this);
+          continue;
+        }
+        if (next - cycle_counter < uint64_t(span))
+          span = static_cast<int>(next - cycle_counter);
+      }
+      if (scope_on) {
+        if (scope_next <= cycle_counter) {
+          push_scope_frame();
+          scope_next += SCOPE_PERIOD;
+          continue;
+        }
+        if (scope_next - cycle_counter < uint64_t(span))
+          span = static_cast<int>(scope_next - cycle_counter);
+      }
+      advance(span);
+      cycle_counter += span;
+      cpu_cycles -= span;
+    }
+    published_cycle.store(cycle_counter, std::memory_order_release);
+  }
+
+  // Work is proportional to the number of events in the span (frame
+  // sequencer steps, plus every channel edge when BLEP is on), not to how
+  // often it is called.
+  void advance(int cpu_cycles) {
+    if (!(nr52 & 0x80)) {
+      blep_time += cpu_cycles;
       return;
-    frame_timer += cpu_cycles;
-    if (frame_timer >= 8192) {
-      frame_timer -= 8192;
-      step_frame_sequencer();
-    }
-    tick_channel_timers(cpu_cycles, ch1.frequency_timer);
-    tick_channel_timers(cpu_cycles, ch2.frequency_timer);
-    tick_channel_timers(cpu_cycles, ch3.frequency_timer);
-    tick_channel_timers(cpu_cycles, ch4.frequency_timer);
-  }
-
-  void tick_channel_timers(int cycles, int &timer) {
-    timer -= cycles;
-    if (timer <= 0) {
-      if (&timer == &ch1.frequency_timer) {
-        ch1.wave_position = (ch1.wave_position + 1) & 7;
-        ch1.frequency_timer += (2048 - ch1.get_frequency()) * 4;
-      } else if (&timer == &ch2.frequency_timer) {
-        ch2.wave_position = (ch2.wave_position + 1) & 7;
-        ch2.frequency_timer += (2048 - ch2.get_frequency()) * 4;
-      } else if (&timer == &ch3.frequency_timer) {
-        ch3.wave_position = (ch3.wave_position + 1) & 31;
-        ch3.frequency_timer += (2048 - ch3.get_frequency()) * 2;
-      } else if (&timer == &ch4.frequency_timer) {
-        ch4.step_lfsr();
+    }
+    while (cpu_cycles > 0) {
+      // Length, envelope and sweep only change on frame sequencer steps,
+      // so the channels run freely between them.
+      int span = 8192 - frame_timer;
+      if (span > cpu_cycles)
+        span = cpu_cycles;
+
+      run_channel(ch1, 0, span);
+      run_channel(ch2, 1, span);
+      run_channel(ch3, 2, span);
+      run_noise(span);
+
+      frame_timer += span;
+      blep_time += span;
+      cpu_cycles -= span;
+
+      if (frame_timer == 8192) {
+        frame_timer = 0;
+        step_frame_sequencer();
+        if (blep_enabled)
+          blep_update_all(blep_time);
       }
     }
   }
 
+  // Advances one channel by `span` cycles. Point sampling only needs the
+  // final state; BLEP jumps from edge to edge and records each one.
+  template <typename Channel>
+  void run_channel(Channel &ch, int channel, int span) {
+    if (!blep_enabled || !ch.enabled) {
+      ch.skip(span);
+      return;
+    }
+    int elapsed = 0;
+    while (ch.frequency_timer <= span - elapsed) {
+      elapsed += ch.frequency_timer;
+      ch.clock();
+      blep_update(channel, blep_time + elapsed);
+    }
+    ch.frequency_timer -= span - elapsed;
+  }
+
+  // Noise clocked faster than the output rate would mean thousands of
+  // edges per sample. Send its mean level once per sample instead, which
+  // the LFSR tables give in O(1).
+  void run_noise(int span) {
+    if (!blep_enabled || !ch4.enabled || ch4.period() >= blep_noise_chunk) {
+      run_channel(ch4, 3, span);
+      return;
+    }
+    int elapsed = 0;
+    while (elapsed < span) {
+      int step = span - elapsed;
+      if (step > blep_noise_timer)
+        step = blep_noise_timer;
+      ch4.skip(step);
+      elapsed += step;
+      blep_noise_timer -= step;
+      if (blep_noise_timer == 0) {
+        blep_noise_timer = blep_noise_chunk;
+        int level = (nr52 & 0x80) ? ch4.take_average(BLEP_UNIT) : 0;
+        blep_set(3, blep_time + elapsed, level);
+      }
+    }
+  }
+
+  void push_scope_frame() {
+    ScopeFrame frame;
+    int left = 0;
+    int right = 0;
+    for (int channel = 0; channel < 4; channel++) {
+      frame.channel[channel] = (nr52 & 0x80) ? channel_output(channel) : 0;
+      left += frame.channel[channel] * BLEP_UNIT * mix_gain_s16[0][channel];
+      right += frame.channel[channel] * BLEP_UNIT * mix_gain_s16[1][channel];
+    }
+    frame.left = static_cast<int16_t>(left >> MIX_S16_SHIFT);
+    frame.right = static_cast<int16_t>(right >> MIX_S16_SHIFT);
+    scope.push(frame);
+  }
+
+  uint8_t channel_output(int channel) {
+    switch (channel) {
+    case 0:
+      return ch1.get_output();
+    case 1:
+      return ch2.get_output();
+    case 2:
+      return ch3.get_output();
+    default:
+      return ch4.get_output();
+    }
+  }
+
+  // Sends the change in a channel's left/right contribution to the blip
+  // buffers. Mixing is linear, so each channel can be tracked on its own.
+  void blep_update(int channel, uint32_t time) {
+    int out = (nr52 & 0x80) ? channel_output(channel) : 0;
+    blep_set(channel, time, out * BLEP_UNIT);
+  }
+
+  // `level` is the channel output in 1/BLEP_UNIT steps
+  void blep_set(int channel, uint32_t time, int level) {
+    int left = level * mix_level[0][channel];
+    int right = level * mix_level[1][channel];
+
+    blep_left.add_delta(time, left - blep_level[0][channel]);
+    blep_right.add_delta(time, right - blep_level[1][channel]);
+    blep_level[0][channel] = left;
+    blep_level[1][channel] = right;
+  }
+
+  void blep_update_all(uint32_t time) {
+    for (int channel = 0; channel < 4; channel++)
+      blep_update(channel, time);
+  }
+
+  // Fills `frames` interleaved stereo samples from the blip buffers,
+  // running the APU exactly as far as needed. Sample is float or int16_t.
+  template <typename Sample> void render_blep(Sample *out, std::size_t frames) {
+    while (frames > 0) {
+      std::size_t chunk = frames < 4096 ? frames : 4096;
+
+      uint32_t target = blep_left.clocks_needed(chunk);
+      if (blep_time < target)
+        tick(target - blep_time);
+      blep_left.end_frame(blep_time);
+      blep_right.end_frame(blep_time);
+      blep_time = 0;
+
+      blep_left.read_samples(out, chunk, 2, blep_scale(out));
+      blep_right.read_samples(out + 1, chunk, 2, blep_scale(out));
+      out += chunk * 2;
+      frames -= chunk;
+    }
+  }
+
+  // Full scale is 480 (4 channels x 15 x 8) levels of BLEP_UNIT steps,
+  // each KERNEL_UNIT in the blip buffer.
+  static float blep_scale(const float *) {
+    return 1.0f / (480.0f * BLEP_UNIT);
+  }
+  static int64_t blep_scale(const int16_t *) {
+    const int64_t full = int64_t(480) * BLEP_UNIT * BlipBuffer::KERNEL_UNIT;
+    return ((int64_t(32767) << 32) + full / 2) / full;
+  }
+
   void step_frame_sequencer() {
     frame_sequencer = (frame_sequencer + 1) & 7;
 
@@ -549,94 +1191,23 @@ public:
   }
 
   void step_length() {
-    if (ch1.nr14 & 0x40 && ch1.length_timer > 0) {
-      ch1.length_timer--;
-      if (ch1.length_timer == 0)
-        ch1.enabled = false;
-    }
-    if (ch2.nr24 & 0x40 && ch2.length_timer > 0) {
-      ch2.length_timer--;
-      if (ch2.length_timer == 0)
-        ch2.enabled = false;
-    }
-    if (ch3.nr34 & 0x40 && ch3.length_timer > 0) {
-      ch3.length_timer--;
-      if (ch3.length_timer == 0)
-        ch3.enabled = false;
-    }
-    if (ch4.nr44 & 0x40 && ch4.length_timer > 0) {
-      ch4.length_timer--;
-      if (ch4.length_timer == 0)
-        ch4.enabled = false;
-    }
+    if (ch1.length.step(ch1.nrx4))
+      ch1.enabled = false;
+    if (ch2.length.step(ch2.nrx4))
+      ch2.enabled = false;
+    if (ch3.length.step(ch3.nr34))
+      ch3.enabled = false;
+    if (ch4.length.step(ch4.nr44))
+      ch4.enabled = false;
   }
 
   void step_envelope() {
-    if (ch1.envelope_timer > 0) {
-      ch1.envelope_timer--;
-      if (ch1.envelope_timer == 0) {
-        ch1.envelope_timer = ch1.nr12 & 0x07;
-        if (ch1.envelope_timer != 0) {
-          if ((ch1.nr12 & 0x08) && ch1.current_volume < 15)
-            ch1.current_volume++;
-          else if (!(ch1.nr12 & 0x08) && ch1.current_volume > 0)
-            ch1.current_volume--;
-        }
-      }
-    }
-    if (ch2.envelope_timer > 0) {
-      ch2.envelope_timer--;
-      if (ch2.envelope_timer == 0) {
-        ch2.envelope_timer = ch2.nr22 & 0x07;
-        if (ch2.envelope_timer != 0) {
-          if ((ch2.nr22 & 0x08) && ch2.current_volume < 15)
-            ch2.current_volume++;
-          else if (!(ch2.nr22 & 0x08) && ch2.current_volume > 0)
-            ch2.current_volume--;
-        }
-      }
-    }
-    if (ch4.envelope_timer > 0) {
-      ch4.envelope_timer--;
-      if (ch4.envelope_timer == 0) {
-        ch4.envelope_timer = ch4.nr42 & 0x07;
-        if (ch4.envelope_timer != 0) {
-          if ((ch4.nr42 & 0x08) && ch4.current_volume < 15)
-            ch4.current_volume++;
-          else if (!(ch4.nr42 & 0x08) && ch4.current_volume > 0)
-            ch4.current_volume--;
-        }
-      }
-    }
+    ch1.envelope.step(ch1.nrx2);
+    ch2.envelope.step(ch2.nrx2);
+    ch4.envelope.step(ch4.nr42);
   }
 
-  void step_sweep() {
-    if (ch1.sweep_enabled && ch1.sweep_timer > 0) {
-      ch1.sweep_timer--;
-      if (ch1.sweep_timer == 0) {
-        int period = (ch1.nr10 >> 4) & 0x07;
-        ch1.sweep_timer = (period == 0) ? 8 : period;
-        if (ch1.sweep_enabled && period > 0) {
-          int shift = ch1.nr10 & 0x07;
-          int delta = ch1.shadow_frequency >> shift;
-          int new_freq = ch1.shadow_frequency;
-
-          if (ch1.nr10 & 0x08)
-            new_freq -= delta; // Subtraction
-          else
-            new_freq += delta; // Addition
-
-          if (new_freq > 2047) {
-            ch1.enabled = false;
-          } else if (new_freq >= 0) {
-            ch1.shadow_frequency = new_freq;
-            ch1.nr13 = new_freq & 0xFF;
-            ch1.nr14 = (ch1.nr14 & 0xF8) | ((new_freq >> 8) & 0x07);
-          }
-        }
-      }
-    }
-  }
+  void step_sweep() { ch1.step_sweep(); }
 
   StereoSample get_sample() {
     if (!(nr52 & 0x80))
@@ -644,39 +1215,174 @@ public:
 
     float left_out = 0.0f;
     float right_out = 0.0f;
+    for (int channel = 0; channel < 4; channel++) {
+      float out = channel_output(channel);
+      left_out += out * mix_gain[0][channel];
+      right_out += out * mix_gain[1][channel];
+    }
+    return {left_out, right_out};
+  }
 
-    uint8_t out1 = ch1.get_output();
-    uint8_t out2 = ch2.get_output();
-    uint8_t out3 = ch3.get_output();
-    uint8_t out4 = ch4.get_output();
-
-    if (nr51 & 0x01)
-      right_out += out1;
-    if (nr51 & 0x10)
-      left_out += out1;
-
-    if (nr51 & 0x02)
-      right_out += out2;
-    if (nr51 & 0x20)
-      left_out += out2;
+  // Fills `frames` interleaved stereo samples. Uses the blip buffers when
+  // BLEP is enabled, otherwise point samples every cycles_per_sample into
+  // one array per channel and mixes whole blocks at a time.
+  void render(float *out, std::size_t frames) {
+    if (blep_enabled) {
+      render_blep(out, frames);
+      return;
+    }
 
-    if (nr51 & 0x04)
-      right_out += out3;
-    if (nr51 & 0x40)
-      left_out += out3;
+    alignas(32) float channels[4][RENDER_BLOCK];
+    while (frames > 0) {
+      std::size_t count = frames < RENDER_BLOCK ? frames : RENDER_BLOCK;
+      for (std::size_t i = 0; i < count; i++) {
+        tick(cycles_per_sample);
+        bool on = nr52 & 0x80;
+        channels[0][i] = on ? ch1.get_output() : 0;
+        channels[1][i] = on ? ch2.get_output() : 0;
+        channels[2][i] = on ? ch3.get_output() : 0;
+        channels[3][i] = on ? ch4.take_average() : 0; // Box filtered
+      }
+      mix_block(channels, mix_gain, out, count);
+      out += count * 2;
+      frames -= count;
+    }
+  }
 
-    if (nr51 & 0x08)
-      right_out += out4;
-    if (nr51 & 0x80)
-      left_out += out4;
+  // out[2i] = sum(channels[c][i] * gain[0][c]), out[2i+1] likewise with
+  // gain[1]. Vectorized over i, four or eight frames per step.
+  static void mix_block(const float (*channels)[RENDER_BLOCK],
+                        const float (*gain)[4], float *out,
+                        std::size_t count) {
+    std::size_t i = 0;
+#if defined(__AVX__)
+    __m256 gl[4], gr[4];
+    for (int c = 0; c < 4; c++) {
+      gl[c] = _mm256_set1_ps(gain[0][c]);
+      gr[c] = _mm256_set1_ps(gain[1][c]);
+    }
+    for (; i + 8 <= count; i += 8) {
+      __m256 left = _mm256_setzero_ps();
+      __m256 right = _mm256_setzero_ps();
+      for (int c = 0; c < 4; c++) {
+        __m256 x = _mm256_load_ps(&channels[c][i]);
+        left = _mm256_add_ps(left, _mm256_mul_ps(x, gl[c]));
+        right = _mm256_add_ps(right, _mm256_mul_ps(x, gr[c]));
+      }
+      // unpack works per 128-bit lane, so swap the middle halves after
+      __m256 lo = _mm256_unpacklo_ps(left, right);
+      __m256 hi = _mm256_unpackhi_ps(left, right);
+      _mm256_storeu_ps(out + i * 2, _mm256_permute2f128_ps(lo, hi, 0x20));
+      _mm256_storeu_ps(out + i * 2 + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
+    }
+#endif
+#if defined(__SSE2__)
+    __m128 sl[4], sr[4];
+    for (int c = 0; c < 4; c++) {
+      sl[c] = _mm_set1_ps(gain[0][c]);
+      sr[c] = _mm_set1_ps(gain[1][c]);
+    }
+    for (; i + 4 <= count; i += 4) {
+      __m128 left = _mm_setzero_ps();
+      __m128 right = _mm_setzero_ps();
+      for (int c = 0; c < 4; c++) {
+        __m128 x = _mm_load_ps(&channels[c][i]);
+        left = _mm_add_ps(left, _mm_mul_ps(x, sl[c]));
+        right = _mm_add_ps(right, _mm_mul_ps(x, sr[c]));
+      }
+      _mm_storeu_ps(out + i * 2, _mm_unpacklo_ps(left, right));
+      _mm_storeu_ps(out + i * 2 + 4, _mm_unpackhi_ps(left, right));
+    }
+#endif
+    for (; i < count; i++) {
+      float left = 0.0f;
+      float right = 0.0f;
+      for (int c = 0; c < 4; c++) {
+        left += channels[c][i] * gain[0][c];
+        right += channels[c][i] * gain[1][c];
+      }
+      out[i * 2] = left;
+      out[i * 2 + 1] = right;
+    }
+  }
 
-    float vol_left = ((nr50 >> 4) & 0x07) + 1;
-    float vol_right = (nr50 & 0x07) + 1;
+  // render() with integer mixing and int16 output: no float math on the
+  // way out, and half the bytes for the device buffer.
+  void render_s16(int16_t *out, std::size_t frames) {
+    if (blep_enabled) {
+      render_blep(out, frames);
+      return;
+    }
 
-    left_out *= vol_left;
-    right_out *= vol_right;
+    alignas(16) int16_t channels[4][RENDER_BLOCK];
+    while (frames > 0) {
+      std::size_t count = frames < RENDER_BLOCK ? frames : RENDER_BLOCK;
+      for (std::size_t i = 0; i < count; i++) {
+        tick(cycles_per_sample);
+        bool on = nr52 & 0x80;
+        channels[0][i] = on ? ch1.get_output() * BLEP_UNIT : 0;
+        channels[1][i] = on ? ch2.get_output() * BLEP_UNIT : 0;
+        channels[2][i] = on ? ch3.get_output() * BLEP_UNIT : 0;
+        channels[3][i] = on ? ch4.take_average(BLEP_UNIT) : 0;
+      }
+      mix_block_s16(channels, mix_gain_s16, out, count);
+      out += count * 2;
+      frames -= count;
+    }
+  }
 
-    return {left_out / 480.0f, right_out / 480.0f};
+  // Integer mix_block(). Products are summed in 32 bits, so the SSE2
+  // path pairs up channels for _mm_madd_epi16 and shifts at the end.
+  static void mix_block_s16(const int16_t (*channels)[RENDER_BLOCK],
+                            const int16_t (*gain)[4], int16_t *out,
+                            std::size_t count) {
+    std::size_t i = 0;
+#if defined(__SSE2__)
+    // Gains for channels (0,1) and (2,3) interleaved to match the data
+    __m128i gl01 = _mm_set1_epi32((gain[0][1] << 16) | uint16_t(gain[0][0]));
+    __m128i gl23 = _mm_set1_epi32((gain[0][3] << 16) | uint16_t(gain[0][2]));
+    __m128i gr01 = _mm_set1_epi32((gain[1][1] << 16) | uint16_t(gain[1][0]));
+    __m128i gr23 = _mm_set1_epi32((gain[1][3] << 16) | uint16_t(gain[1][2]));
+    for (; i + 8 <= count; i += 8) {
+      __m128i c0 = _mm_load_si128((const __m128i *)&channels[0][i]);
+      __m128i c1 = _mm_load_si128((const __m128i *)&channels[1][i]);
+      __m128i c2 = _mm_load_si128((const __m128i *)&channels[2][i]);
+      __m128i c3 = _mm_load_si128((const __m128i *)&channels[3][i]);
+      __m128i lo01 = _mm_unpacklo_epi16(c0, c1);
+      __m128i hi01 = _mm_unpackhi_epi16(c0, c1);
+      __m128i lo23 = _mm_unpacklo_epi16(c2, c3);
+      __m128i hi23 = _mm_unpackhi_epi16(c2, c3);
+
+      __m128i left_lo = _mm_add_epi32(_mm_madd_epi16(lo01, gl01),
+                                      _mm_madd_epi16(lo23, gl23));
+      __m128i left_hi = _mm_add_epi32(_mm_madd_epi16(hi01, gl01),
+                                      _mm_madd_epi16(hi23, gl23));
+      __m128i right_lo = _mm_add_epi32(_mm_madd_epi16(lo01, gr01),
+                                       _mm_madd_epi16(lo23, gr23));
+      __m128i right_hi = _mm_add_epi32(_mm_madd_epi16(hi01, gr01),
+                                       _mm_madd_epi16(hi23, gr23));
+
+      __m128i left = _mm_packs_epi32(_mm_srai_epi32(left_lo, MIX_S16_SHIFT),
+                                     _mm_srai_epi32(left_hi, MIX_S16_SHIFT));
+      __m128i right =
+          _mm_packs_epi32(_mm_srai_epi32(right_lo, MIX_S16_SHIFT),
+                          _mm_srai_epi32(right_hi, MIX_S16_SHIFT));
+      _mm_storeu_si128((__m128i *)(out + i * 2),
+                       _mm_unpacklo_epi16(left, right));
+      _mm_storeu_si128((__m128i *)(out + i * 2 + 8),
+                       _mm_unpackhi_epi16(left, right));
+    }
+#endif
+    for (; i < count; i++) {
+      int32_t left = 0;
+      int32_t right = 0;
+      for (int c = 0; c < 4; c++) {
+        left += channels[c][i] * gain[0][c];
+        right += channels[c][i] * gain[1][c];
+      }
+      out[i * 2] = static_cast<int16_t>(left >> MIX_S16_SHIFT);
+      out[i * 2 + 1] = static_cast<int16_t>(right >> MIX_S16_SHIFT);
+    }
   }
 
   uint8_t read_byte(uint16_t addr) {
@@ -727,11 +1433,13 @@ public:
     else if (addr >= 0xFF30 && addr <= 0xFF3F)
       ch3.write_wave_ram(addr, value);
 
-    else if (addr == 0xFF24)
+    else if (addr == 0xFF24) {
       nr50 = value;
-    else if (addr == 0xFF25)
+      update_mix();
+    } else if (addr == 0xFF25) {
       nr51 = value;
-    else if (addr == 0xFF26) {
+      update_mix();
+    } else if (addr == 0xFF26) {
       bool turn_on = value & 0x80;
       if (turn_on && !(nr52 & 0x80)) {
         frame_sequencer = 0;
@@ -741,11 +1449,15 @@ public:
       }
       nr52 = value;
     }
+
+    if (blep_enabled)
+      blep_update_all(blep_time);
   }
 
   void clear_all_registers() {
     nr50 = 0;
     nr51 = 0;
+    update_mix();
     ch1.enabled = false;
     ch2.enabled = false;
     ch3.enabled = false;
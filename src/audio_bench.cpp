@@ -0,0 +1,192 @@
+// Micro-benchmarks for the audio core. Times APU::tick() plus
+// get_sample() per output sample for a few channel setups and tick sizes,
+// and prints the results as JSON so runs can be compared over time.
+//
+// Usage: AudioBench [options]
+//   -o FILE       Write the JSON here instead of stdout
+//   --seconds S   Emulated audio per measurement (default 2)
+//   --repeat N    Runs per measurement, the fastest one is kept (default 5)
+//   --rate HZ     Output sample rate (default 48000)
+//   --filter STR  Only run configs whose name contains STR
+
+#include "audio.cpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct BenchConfig {
+  const char *name;
+  std::vector<std::pair<uint16_t, uint8_t>> writes; // After power on
+};
+
+// Every config keeps its channels sounding for the whole run: length
+// counters off and envelopes at a fixed volume.
+std::vector<BenchConfig> bench_configs() {
+  std::vector<std::pair<uint16_t, uint8_t>> ch1 = {
+      {0xFF10, 0x00}, {0xFF11, 0x80}, {0xFF12, 0xF0},
+      {0xFF13, 0x06}, {0xFF14, 0x87}};
+  std::vector<std::pair<uint16_t, uint8_t>> ch2 = {
+      {0xFF16, 0x40}, {0xFF17, 0xF0}, {0xFF18, 0x59}, {0xFF19, 0x87}};
+  std::vector<std::pair<uint16_t, uint8_t>> ch3 = {{0xFF1A, 0x00}};
+  for (int i = 0; i < 16; i++) // Sawtooth
+    ch3.push_back({uint16_t(0xFF30 + i), uint8_t((i * 2) << 4 | (i * 2 + 1))});
+  ch3.insert(ch3.end(), {{0xFF1A, 0x80},
+                         {0xFF1C, 0x20},
+                         {0xFF1D, 0xD6},
+                         {0xFF1E, 0x86}});
+  std::vector<std::pair<uint16_t, uint8_t>> ch4 = {
+      {0xFF21, 0xF0}, {0xFF22, 0x35}, {0xFF23, 0x80}};
+
+  std::vector<BenchConfig> configs;
+  configs.push_back({"ch1", ch1});
+  configs.push_back({"ch2", ch2});
+  configs.push_back({"ch3", ch3});
+  configs.push_back({"ch4", ch4});
+
+  BenchConfig all = {"all", {}};
+  for (auto *writes : {&ch1, &ch2, &ch3, &ch4})
+    all.writes.insert(all.writes.end(), writes->begin(), writes->end());
+  configs.push_back(all);
+
+  // Shift 0, divisor 0: the LFSR steps every 8 cycles
+  configs.push_back({"noise_max_clock",
+                     {{0xFF21, 0xF0}, {0xFF22, 0x00}, {0xFF23, 0x80}}});
+  configs.push_back({"noise_max_clock_7bit",
+                     {{0xFF21, 0xF0}, {0xFF22, 0x08}, {0xFF23, 0x80}}});
+
+  // Sweep every 128Hz step, shift 7, decreasing so it never overflows
+  configs.push_back({"ch1_sweep",
+                     {{0xFF10, 0x1F}, {0xFF11, 0x80}, {0xFF12, 0xF0},
+                      {0xFF13, 0xFF}, {0xFF14, 0x87}}});
+  return configs;
+}
+
+struct BenchResult {
+  std::string config;
+  int tick_cycles;
+  double ns_per_sample;
+  double ns_per_cycle;
+};
+
+volatile float bench_sink; // Keeps the samples from being optimized out
+
+// One timed run: `samples` output samples, ticking `tick_cycles` at a time
+// and taking a sample whenever the clock passes the next sample point.
+double run_once(const BenchConfig &config, int tick_cycles, int rate,
+                std::size_t samples) {
+  std::unique_ptr<APU> apu(new APU());
+  apu->write_byte(0xFF26, 0x80);
+  apu->write_byte(0xFF24, 0x77);
+  apu->write_byte(0xFF25, 0xFF);
+  for (const auto &w : config.writes)
+    apu->write_byte(w.first, w.second);
+  apu->set_sample_rate(rate);
+
+  uint64_t cycle = 0;
+  uint64_t next_sample = 0;
+  std::size_t done = 0;
+  float sum = 0.0f;
+  auto start = std::chrono::steady_clock::now();
+  while (done < samples) {
+    apu->tick(tick_cycles);
+    cycle += tick_cycles;
+    while (done < samples && cycle >= next_sample) {
+      APU::StereoSample s = apu->get_sample();
+      sum += s.left + s.right;
+      done++;
+      next_sample = done * uint64_t(APU::CLOCK_RATE) / rate;
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+  bench_sink = sum;
+  return std::chrono::duration<double, std::nano>(end - start).count();
+}
+
+void write_json(std::FILE *out, const std::vector<BenchResult> &results,
+                int rate, double seconds, int repeat) {
+  std::fprintf(out, "{\n");
+  std::fprintf(out, "  \"benchmark\": \"apu_tick_get_sample\",\n");
+  std::fprintf(out, "  \"sample_rate\": %d,\n", rate);
+  std::fprintf(out, "  \"seconds\": %g,\n", seconds);
+  std::fprintf(out, "  \"repeat\": %d,\n", repeat);
+  std::fprintf(out, "  \"results\": [");
+  for (std::size_t i = 0; i < results.size(); i++) {
+    const BenchResult &r = results[i];
+    std::fprintf(out,
+                 "%s\n    {\"config\": \"%s\", \"tick_cycles\": %d, "
+                 "\"ns_per_sample\": %.3f, \"ns_per_cycle\": %.4f}",
+                 i ? "," : "", r.config.c_str(), r.tick_cycles,
+                 r.ns_per_sample, r.ns_per_cycle);
+  }
+  std::fprintf(out, "\n  ]\n}\n");
+}
+
+int main(int argc, char **argv) {
+  const char *output = nullptr;
+  const char *filter = nullptr;
+  double seconds = 2.0;
+  int repeat = 5;
+  int rate = 48000;
+
+  for (int i = 1; i < argc; i++) {
+    bool has_value = i + 1 < argc;
+    if (!std::strcmp(argv[i], "-o") && has_value)
+      output = argv[++i];
+    else if (!std::strcmp(argv[i], "--seconds") && has_value)
+      seconds = std::atof(argv[++i]);
+    else if (!std::strcmp(argv[i], "--repeat") && has_value)
+      repeat = std::atoi(argv[++i]);
+    else if (!std::strcmp(argv[i], "--rate") && has_value)
+      rate = std::atoi(argv[++i]);
+    else if (!std::strcmp(argv[i], "--filter") && has_value)
+      filter = argv[++i];
+    else {
+      std::fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      return 1;
+    }
+  }
+  if (seconds <= 0 || repeat <= 0 || rate <= 0 || rate > APU::CLOCK_RATE) {
+    std::fprintf(stderr, "Invalid --seconds, --repeat or --rate\n");
+    return 1;
+  }
+
+  const int TICK_SIZES[] = {1, 4, 95, 4096};
+  std::size_t samples = static_cast<std::size_t>(seconds * rate);
+  std::vector<BenchResult> results;
+
+  for (const BenchConfig &config : bench_configs()) {
+    if (filter && !std::strstr(config.name, filter))
+      continue;
+    for (int tick_cycles : TICK_SIZES) {
+      run_once(config, tick_cycles, rate, samples / 10); // Warm up
+      double best = 0.0;
+      for (int r = 0; r < repeat; r++) {
+        double ns = run_once(config, tick_cycles, rate, samples);
+        if (r == 0 || ns < best)
+          best = ns;
+      }
+      double cycles = double(samples) * APU::CLOCK_RATE / rate;
+      results.push_back({config.name, tick_cycles, best / samples,
+                         best / cycles});
+      std::fprintf(stderr, "%-22s tick %4d: %8.2f ns/sample\n", config.name,
+                   tick_cycles, best / samples);
+    }
+  }
+
+  std::FILE *out = stdout;
+  if (output) {
+    out = std::fopen(output, "w");
+    if (!out) {
+      std::fprintf(stderr, "Can't write %s\n", output);
+      return 1;
+    }
+  }
+  write_json(out, results, rate, seconds, repeat);
+  if (out != stdout)
+    std::fclose(out);
+  return 0;
+}
@@ -0,0 +1,304 @@
+// Records a session to disk without holding up emulation: LCD frames to
+// a Y4M (or raw RGBA) file and APU output to a WAV file. The emulator
+// side only copies into preallocated slots and hands them over through
+// SpscRings; a writer thread converts and writes them in large blocks.
+//
+// push_frame() and push_samples() may be called from different threads
+// (game loop and audio callback), but each from one thread only. When
+// the writer falls behind, nothing blocks: a frame that finds no free
+// slot is recorded as a repeat of the previous one, which keeps the
+// video's timing, and samples that don't fit are dropped. Only with the
+// queue itself full is a frame left out of the video. The counters say
+// how often each happened.
+#pragma once
+
+#include "spsc_ring.cpp"
+#include "video.cpp"
+#include "wav.cpp"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+class CaptureWriter {
+public:
+  enum VideoFormat { Y4M, RawRGBA };
+
+  static constexpr int WIDTH = LCD::SCREEN_WIDTH;
+  static constexpr int HEIGHT = LCD::SCREEN_HEIGHT;
+  static constexpr int FRAME_SLOTS = 8;     // Frames waiting to be written
+  static constexpr int AUDIO_SLOTS = 16;    // Audio blocks waiting
+  static constexpr int AUDIO_BLOCK = 16384; // int16 samples per block
+  static constexpr std::size_t STAGING_SIZE = 1 << 20; // Bytes per write
+  // 4194304 / 70224 Hz, the LCD's real frame rate
+  static constexpr const char *Y4M_HEADER =
+      "YUV4MPEG2 W160 H144 F4194304:70224 Ip A1:1 C444\n";
+
+  std::string error; // Why open() failed
+
+  std::atomic<uint64_t> frames_written{0};  // Including repeats
+  std::atomic<uint64_t> frames_repeated{0}; // Unchanged, not copied
+  std::atomic<uint64_t> frames_replaced{0}; // By a repeat, no free slot
+  std::atomic<uint64_t> frames_dropped{0};  // Lost to a full queue
+  std::atomic<uint64_t> samples_written{0}; // Stereo frames
+  std::atomic<uint64_t> samples_dropped{0};
+
+  CaptureWriter() {}
+  ~CaptureWriter() { close(); }
+
+  // Starts capturing. Either path may be nullptr to skip that stream.
+  // sample_rate is that of the stereo int16 samples pushed.
+  bool open(const char *video_path, VideoFormat format,
+            const char *audio_path, int sample_rate) {
+    close();
+    error.clear();
+    video_format = format;
+    if (video_path) {
+      video = std::fopen(video_path, "wb");
+      if (!video) {
+        error = std::string("Can't write ") + video_path;
+        return false;
+      }
+      std::setvbuf(video, nullptr, _IONBF, 0); // Staging does the buffering
+      staging = static_cast<uint8_t *>(std::aligned_alloc(4096, STAGING_SIZE));
+      if (!staging) {
+        error = "Out of memory for the staging buffer";
+        close();
+        return false;
+      }
+      staged = 0;
+      have_frame = false;
+      frame_pool.assign(std::size_t(FRAME_SLOTS) * WIDTH * HEIGHT, 0);
+      for (int i = 0; i < FRAME_SLOTS; i++)
+        free_frames.push(i);
+      if (format == Y4M)
+        stage(Y4M_HEADER, std::strlen(Y4M_HEADER));
+    }
+    if (audio_path) {
+      if (!wav.open(audio_path, sample_rate, 2, WavWriter::PCM16)) {
+        error = std::string("Can't write ") + audio_path;
+        close();
+        return false;
+      }
+      audio_pool.assign(std::size_t(AUDIO_SLOTS) * AUDIO_BLOCK, 0);
+      for (int i = 0; i < AUDIO_SLOTS; i++)
+        free_blocks.push(i);
+      filling = -1;
+    }
+    stopping = false;
+    running = true;
+    writer = std::thread([this] { run(); });
+    return true;
+  }
+
+  bool is_open() const { return running; }
+
+  // Queues a frame of WIDTH x HEIGHT pixels as the LCD draws them.
+  // Pass changed = false for a frame known to match the last one (no
+  // changed lines), which is queued as a repeat without copying it.
+  void push_frame(const uint32_t *pixels, bool changed = true) {
+    if (!running || !video)
+      return;
+    if (frame_queue.size() == frame_queue.capacity()) {
+      frames_dropped++; // Not even room for a repeat
+      return;
+    }
+    if (!have_frame)
+      changed = true; // Nothing to repeat yet, so copy it whatever
+    int slot = REPEAT;
+    if (changed && !free_frames.pop(slot)) {
+      slot = REPEAT; // Writer behind, keep the timing at least
+      if (!have_frame) {
+        frames_dropped++;
+        return;
+      }
+      frames_replaced++;
+    } else if (!changed) {
+      frames_repeated++;
+    }
+    if (slot != REPEAT) {
+      have_frame = true;
+      std::memcpy(&frame_pool[std::size_t(slot) * WIDTH * HEIGHT], pixels,
+                  WIDTH * HEIGHT * sizeof(uint32_t));
+    }
+    frame_queue.push(slot);
+  }
+
+  // Queues interleaved stereo samples, as APU::render_s16() makes them
+  void push_samples(const int16_t *samples, std::size_t frames) {
+    if (!running || !wav.is_open())
+      return;
+    std::size_t count = frames * 2;
+    while (count > 0) {
+      if (filling < 0) {
+        if (!free_blocks.pop(filling)) {
+          filling = -1;
+          samples_dropped += count / 2;
+          return;
+        }
+        filled = 0;
+      }
+      std::size_t n = AUDIO_BLOCK - filled;
+      if (n > count)
+        n = count;
+      std::memcpy(&audio_pool[std::size_t(filling) * AUDIO_BLOCK + filled],
+                  samples, n * sizeof(int16_t));
+      filled += n;
+      samples += n;
+      count -= n;
+      if (filled == AUDIO_BLOCK)
+        flush_block();
+    }
+  }
+
+  // Writes out everything queued and closes the files. Call from the
+  // thread that pushes samples, or once it has stopped.
+  void close() {
+    if (running.exchange(false)) { // No more pushes from here on
+      if (filling >= 0)
+        flush_block();
+      stopping.store(true, std::memory_order_release);
+      writer.join();
+    }
+    if (video) {
+      write_staging();
+      std::fclose(video);
+      video = nullptr;
+    }
+    std::free(staging);
+    staging = nullptr;
+    wav.close();
+    reset_queues();
+  }
+
+private:
+  static constexpr int REPEAT = -1; // Queued instead of a frame slot
+
+  struct AudioBlock {
+    int slot;
+    int count; // Samples, not stereo frames
+  };
+
+  VideoFormat video_format = Y4M;
+  std::FILE *video = nullptr;
+  WavWriter wav;
+
+  std::vector<uint32_t> frame_pool;
+  std::vector<int16_t> audio_pool;
+  SpscRing<int, 64> frame_queue;          // Emulator to writer
+  SpscRing<int, FRAME_SLOTS> free_frames; // Writer to emulator
+  SpscRing<AudioBlock, AUDIO_SLOTS> audio_queue;
+  SpscRing<int, AUDIO_SLOTS> free_blocks;
+  int filling = -1; // Audio block being filled by push_samples()
+  std::size_t filled = 0;
+  bool have_frame = false; // push_frame() has copied one, for repeats
+
+  std::thread writer;
+  std::atomic<bool> running{false};
+  std::atomic<bool> stopping{false};
+
+  // Writer thread only
+  int last_slot = REPEAT; // Frame a repeat writes again, held back
+  uint8_t *staging = nullptr;
+  std::size_t staged = 0;
+
+  // The queue has room for every block, so this can't fail
+  void flush_block() {
+    audio_queue.push({filling, int(filled)});
+    filling = -1;
+    filled = 0;
+  }
+
+  // Empties the rings for the next open(), with the writer stopped
+  void reset_queues() {
+    int slot;
+    while (frame_queue.pop(slot)) {
+    }
+    while (free_frames.pop(slot)) {
+    }
+    AudioBlock block;
+    while (audio_queue.pop(block)) {
+    }
+    while (free_blocks.pop(slot)) {
+    }
+    last_slot = REPEAT;
+  }
+
+  void run() {
+    while (true) {
+      bool stop = stopping.load(std::memory_order_acquire);
+      bool busy = false;
+      int slot;
+      while (frame_queue.pop(slot)) {
+        write_frame(slot);
+        busy = true;
+      }
+      AudioBlock block;
+      while (audio_queue.pop(block)) {
+        wav.write(&audio_pool[std::size_t(block.slot) * AUDIO_BLOCK],
+                  block.count / 2);
+        samples_written += block.count / 2;
+        free_blocks.push(block.slot);
+        busy = true;
+      }
+      if (stop) // Everything pushed before stopping is written now
+        return;
+      if (!busy)
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+  }
+
+  void write_frame(int slot) {
+    if (slot == REPEAT) {
+      slot = last_slot; // push_frame() copies a frame before any repeat
+    } else if (last_slot != REPEAT) {
+      free_frames.push(last_slot);
+    }
+    last_slot = slot;
+    const uint32_t *pixels = &frame_pool[std::size_t(slot) * WIDTH * HEIGHT];
+
+    std::size_t size = video_format == Y4M ? 6 + WIDTH * HEIGHT * 3
+                                           : WIDTH * HEIGHT * 4;
+    if (staged + size > STAGING_SIZE)
+      write_staging();
+    uint8_t *out = staging + staged;
+    if (video_format == RawRGBA) {
+      std::memcpy(out, pixels, size);
+    } else {
+      std::memcpy(out, "FRAME\n", 6);
+      uint8_t *y = out + 6;
+      uint8_t *u = y + WIDTH * HEIGHT;
+      uint8_t *v = u + WIDTH * HEIGHT;
+      for (int i = 0; i < WIDTH * HEIGHT; i++)
+        to_yuv(pixels[i], y[i], u[i], v[i]);
+    }
+    staged += size;
+    frames_written++;
+  }
+
+  // BT.601, studio range
+  static void to_yuv(uint32_t pixel, uint8_t &y, uint8_t &u, uint8_t &v) {
+    int r = pixel & 0xFF;
+    int g = (pixel >> 8) & 0xFF;
+    int b = (pixel >> 16) & 0xFF;
+    y = uint8_t(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+    u = uint8_t(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+    v = uint8_t(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+  }
+
+  void stage(const void *data, std::size_t size) {
+    std::memcpy(staging + staged, data, size);
+    staged += size;
+  }
+
+  void write_staging() {
+    if (staged > 0)
+      std::fwrite(staging, 1, staged, video);
+    staged = 0;
+  }
+};
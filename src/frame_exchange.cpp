@@ -0,0 +1,88 @@
+// Hands finished frames from the emulator to the frontend without copying
+// them. Three framebuffers live here for good: the producer (an LCD, or a
+// RenderPipeline's worker) draws straight into the back one, the consumer
+// (the draw loop) reads the front one, and finished frames wait in the
+// middle. Swaps are a single atomic exchange of buffer indices, so neither
+// side ever waits for the other, and a slow consumer just skips frames.
+//
+// One producer thread and one consumer thread, which may be the same.
+#pragma once
+
+#include "video.cpp"
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+
+class FrameExchange {
+public:
+  static constexpr int WIDTH = LCD::SCREEN_WIDTH;
+  static constexpr int HEIGHT = LCD::SCREEN_HEIGHT;
+
+  struct Frame {
+    const uint32_t *pixels; // RGBA, R in the low byte, as the LCD draws
+    const bool *changed;    // Lines that differ from frame number - 1
+    uint64_t number;        // From 1, 0 for the blank frame at the start
+  };
+
+  FrameExchange() {
+    std::memset(buffers, 0xFF, sizeof(buffers));
+    std::memset(changed, 1, sizeof(changed));
+    for (uint64_t &n : numbers)
+      n = 0;
+    back = 0;
+    front = 2;
+    published = 0;
+  }
+
+  // =============================================================
+  // Producer side
+  // =============================================================
+  uint32_t *back_buffer() { return buffers[back]; }
+
+  // Points the LCD at the back buffer; call once before its first frame
+  void attach(LCD &lcd) { lcd.output = buffers[back]; }
+
+  // Publishes the frame the LCD just finished, normally on V-Blank, and
+  // points it at the next back buffer. Lines it didn't draw, with the
+  // LCD off for part or all of the frame, go out blank rather than as
+  // whatever the recycled buffer held.
+  void present(LCD &lcd) {
+    lcd.blank_undrawn_lines();
+    lcd.take_dirty_lines(changed[back]);
+    numbers[back] = ++published;
+    back = state.exchange(back | FRESH, std::memory_order_acq_rel) & INDEX;
+    lcd.output = buffers[back];
+  }
+
+  // =============================================================
+  // Consumer side
+  // =============================================================
+
+  // Swaps in the newest published frame. False when there is nothing
+  // newer than current(), so there's nothing new to present.
+  bool acquire() {
+    if (!(state.load(std::memory_order_acquire) & FRESH))
+      return false;
+    front = state.exchange(front, std::memory_order_acq_rel) & INDEX;
+    return true;
+  }
+
+  // The frame acquired last, untouched by the producer until the next
+  // acquire()
+  Frame current() const {
+    return {buffers[front], changed[front], numbers[front]};
+  }
+
+private:
+  static constexpr int INDEX = 3; // Middle buffer's index, in state
+  static constexpr int FRESH = 4; // Middle buffer not yet acquired
+
+  alignas(64) uint32_t buffers[3][WIDTH * HEIGHT];
+  bool changed[3][HEIGHT];
+  uint64_t numbers[3];
+
+  int back;  // Producer's
+  int front; // Consumer's
+  uint64_t published;
+  alignas(64) std::atomic<int> state{1};
+};
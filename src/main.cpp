@@ -1,5 +1,16 @@
 #include "audio.cpp" // Your APU implementation
+#include "capture.cpp"
+#include "frame_exchange.cpp"
 #include "raylib.h"
+#include "music.cpp"
+#include "resampler.cpp"
+#include "sequencer.cpp"
+#include "spectrum.cpp"
+#include "upscale.cpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
 #include <iostream>
 #include <vector>
 
@@ -7,102 +18,231 @@
 // GLOBAL STATE
 // ============================================================================
 APU apu;
-const int SAMPLE_RATE = 44100;
-const int CYCLES_PER_SAMPLE = 4194304 / SAMPLE_RATE;
+Resampler resampler;
+RateControl rate_control;
+Sequencer sequencer; // Plays the music from inside the audio thread
+LCD lcd;
+FrameExchange frame_exchange; // The LCD draws straight into these
+CaptureWriter capture; // Records the session with --capture
+const int SAMPLE_RATE = 48000;             // Device rate, any rate works
+const int APU_RATE = APU::CLOCK_RATE / 64; // 65536 Hz, whole cycles/sample
+
+// Emulated time on the game thread, one LCD frame (70224 cycles) per
+// loop like the video, so the two agree. MUSIC_LATENCY is the lead that rate
+// control steers for, the APU's distance to game_cycle + MUSIC_LATENCY,
+// and the scale of drift AdvanceGameClock() puts up with.
+std::atomic<uint64_t> game_cycle{0};
+const uint64_t MUSIC_LATENCY = LCD::CYCLES_PER_FRAME * 4;
 
 // ============================================================================
 // AUDIO CALLBACK
 // ============================================================================
 void GameAudioCallback(void *buffer, unsigned int frames) {
-  float *d = (float *)buffer;
-  for (unsigned int i = 0; i < frames; i++) {
-    apu.tick(CYCLES_PER_SAMPLE);
-    APU::StereoSample sample = apu.get_sample();
-    d[i * 2] = sample.left;
-    d[i * 2 + 1] = sample.right;
-  }
+  int16_t *d = (int16_t *)buffer; // 16-bit stream, mixed in integers
+
+  // Speed up or slow down slightly so the audio clock trails the game
+  // clock by MUSIC_LATENCY, however the two clocks drift.
+  double lead = double(game_cycle.load() + MUSIC_LATENCY) -
+                double(apu.current_cycle());
+  resampler.set_adjust(rate_control.update(lead, MUSIC_LATENCY));
+
+  resampler.process(d, frames, [](int16_t *out, std::size_t n) {
+    apu.render_s16(out, n);
+  });
+  capture.push_samples(d, frames); // Does nothing unless capturing
 }
 
-// ============================================================================
-// HELPER: NOTE FREQUENCIES
-// These are the raw 11-bit values the Game Boy uses for notes
-// Formula: x = 2048 - (131072 / Frequency)
-// ============================================================================
-const int NOTE_E5 = 1650;
-const int NOTE_B4 = 1546;
-const int NOTE_C5 = 1576;
-const int NOTE_D5 = 1602;
-const int NOTE_A4 = 1496;
-const int NOTE_G4 = 1428;
-const int NOTE_F4 = 1360; // Approximate
-
-struct Note {
-  int frequency; // The raw 11-bit value
-  int duration;  // In frames (60ths of a second)
-};
-
-// THE TETRIS THEME (Korobeiniki)
-// Melody: E -> B -> C -> D -> C -> B -> A ...
-std::vector<Note> tetris_melody = {
-    {NOTE_E5, 20}, {NOTE_B4, 10}, {NOTE_C5, 10}, {NOTE_D5, 20}, {NOTE_C5, 10},
-    {NOTE_B4, 10}, {NOTE_A4, 20}, {NOTE_A4, 10}, {NOTE_C5, 10}, {NOTE_E5, 20},
-    {NOTE_D5, 10}, {NOTE_C5, 10}, {NOTE_B4, 30}, {NOTE_C5, 10}, {NOTE_D5, 20},
-    {NOTE_E5, 20}, {NOTE_C5, 20}, {NOTE_A4, 20}, {NOTE_A4, 40}, {0, 10}, // Rest
-    {NOTE_D5, 20}, {NOTE_F4, 10}, {NOTE_A4, 20}, {NOTE_G4, 10}, {NOTE_F4, 10},
-    {NOTE_E5, 30}, {NOTE_C5, 10}, {NOTE_E5, 20}, {NOTE_D5, 10}, {NOTE_C5, 10},
-    {NOTE_B4, 20}, {NOTE_B4, 10}, {NOTE_C5, 10}, {NOTE_D5, 20}, {NOTE_E5, 20},
-    {NOTE_C5, 20}, {NOTE_A4, 20}, {NOTE_A4, 40}};
-
-int current_note_index = 0;
-int note_timer = 0;
+// Moves the game clock on by one frame, snapping it back to the audio
+// thread if they have drifted too far apart (window drag, device stall).
+void AdvanceGameClock() {
+  uint64_t audio = apu.current_cycle();
+  uint64_t now = game_cycle.load() + LCD::CYCLES_PER_FRAME;
+  if (now + MUSIC_LATENCY < audio || now > audio + MUSIC_LATENCY * 4)
+    now = audio;
+  game_cycle.store(now);
+}
 
 // ============================================================================
-// PLAY NEXT NOTE LOGIC
-// This mimics the Game Boy Sound Engine updates
+// VISUALIZER
+// Draws what the APU actually outputs, read from its scope tap: one trace
+// per channel, the mix, and a spectrum of the mix.
 // ============================================================================
-void UpdateMusic() {
-  if (note_timer > 0) {
-    note_timer--;
-    return;
+const int SCOPE_HISTORY = 1024; // Frames kept, a power of two
+const int SCOPE_WIDTH = 360;    // Frames (and pixels) per trace
+APU::ScopeFrame scope_history[SCOPE_HISTORY];
+int scope_pos = 0;
+Spectrum spectrum;
+
+void ReadScope() {
+  APU::ScopeFrame frame;
+  while (apu.scope.pop(frame)) {
+    scope_history[scope_pos] = frame;
+    scope_pos = (scope_pos + 1) & (SCOPE_HISTORY - 1);
+    spectrum.push((frame.left + frame.right) / 65536.0f);
+  }
+  spectrum.compute();
+}
+
+// Level of trace `trace` (0-3 channels, 4 the mix) in [0, 1]
+float ScopeLevel(const APU::ScopeFrame &frame, int trace) {
+  if (trace < 4)
+    return frame.channel[trace] / 15.0f;
+  return (frame.left + frame.right) / 65534.0f;
+}
+
+void DrawScope(int trace, int x, int y, int height, Color color) {
+  // Start on a rising edge so a steady note holds still
+  int oldest = scope_pos - SCOPE_WIDTH * 2;
+  int start = oldest;
+  for (int i = 1; i < SCOPE_WIDTH; i++) {
+    int at = oldest + i;
+    if (ScopeLevel(scope_history[(at - 1) & (SCOPE_HISTORY - 1)], trace) <
+        ScopeLevel(scope_history[at & (SCOPE_HISTORY - 1)], trace)) {
+      start = at;
+      break;
+    }
   }
 
-  // Get the next note
-  Note n = tetris_melody[current_note_index];
-  current_note_index = (current_note_index + 1) % tetris_melody.size();
+  DrawLine(x, y + height, x + SCOPE_WIDTH, y + height, LIGHTGRAY);
+  int last_y = 0;
+  for (int i = 0; i < SCOPE_WIDTH; i++) {
+    const APU::ScopeFrame &frame =
+        scope_history[(start + i) & (SCOPE_HISTORY - 1)];
+    int py = y + height - static_cast<int>(ScopeLevel(frame, trace) * height);
+    if (i > 0)
+      DrawLine(x + i - 1, last_y, x + i, py, color);
+    last_y = py;
+  }
+}
 
-  // Reset timer
-  note_timer = n.duration;
+void DrawSpectrum(int x, int y, int width, int height) {
+  const int BARS = 36;
+  const float LOW = 50.0f;
+  const float HIGH = 16000.0f;
+  int bar_width = width / BARS;
+  for (int i = 0; i < BARS; i++) {
+    float from = LOW * std::pow(HIGH / LOW, float(i) / BARS);
+    float to = LOW * std::pow(HIGH / LOW, float(i + 1) / BARS);
+    float db = spectrum.band(from, to);
+    float level = (db + 72.0f) / 72.0f; // Show the top 72dB
+    if (level < 0.0f)
+      level = 0.0f;
+    if (level > 1.0f)
+      level = 1.0f;
+    int h = static_cast<int>(level * height);
+    DrawRectangle(x + i * bar_width, y + height - h, bar_width - 1, h, RED);
+  }
+}
 
-  if (n.frequency == 0) {
-    // Rest (Silence)
-    // We set volume to 0 (Envelope 0, Direction 0)
-    apu.write_byte(0xFF12, 0x00);
-    apu.write_byte(0xFF14, 0x80); // Trigger to apply
-  } else {
-    // Play Note on Channel 1
-    // NR10: Sweep Off
-    apu.write_byte(0xFF10, 0x00);
+// ============================================================================
+// SCREEN
+// Frames come from the LCD through the FrameExchange, go through the
+// upscaler chain, and into a texture of the chain's output size. With no
+// chain only the lines that changed since the frame on screen are sent,
+// a run of whole rows at a time.
+// ============================================================================
+Texture2D screen;
+uint64_t screen_frame = 0; // Number of the frame in the texture
+Upscaler upscaler;
+bool ghosting = false; // Output keeps changing after the frames stop
 
-    // NR11: Duty 50% (0x80), Length doesn't matter much here
-    apu.write_byte(0xFF11, 0x80);
+// Runs the LCD up to its next V-Blank, or for a frame's worth of cycles
+// while it is off, and publishes the frame
+void RunVideoFrame() {
+  uint64_t frame = lcd.frame_count;
+  int cycles = 0;
+  while (lcd.frame_count == frame && cycles < LCD::CYCLES_PER_FRAME) {
+    int step = lcd.next_event();
+    if (step < 0)
+      break; // LCD off, nothing happens until it's back on
+    lcd.tick(step);
+    cycles += step;
+  }
+  frame_exchange.present(lcd); // Blank if the LCD is off
+}
 
-    // NR12: Volume 10 (0xA), Decay (0), Speed 2
-    // This gives it that "plucky" Game Boy sound
-    apu.write_byte(0xFF12, 0xA2);
+// Uploads the newest frame, and records it when capturing. Returns false,
+// having uploaded nothing, when there's no new frame or it matches the
+// one on screen.
+bool UpdateScreen() {
+  if (!frame_exchange.acquire())
+    return false;
+  FrameExchange::Frame frame = frame_exchange.current();
+  bool all = frame.number != screen_frame + 1; // Skipped one, send it all
+  screen_frame = frame.number;
+  bool changed =
+      all || std::any_of(frame.changed, frame.changed + FrameExchange::HEIGHT,
+                         [](bool line) { return line; });
+  capture.push_frame(frame.pixels, changed);
 
-    // NR13: Frequency Low Byte
-    apu.write_byte(0xFF13, n.frequency & 0xFF);
+  // The stages mix neighbouring lines, so any change redoes the frame
+  if (!upscaler.stages.empty()) {
+    if (!changed && !ghosting)
+      return false;
+    UpdateTexture(screen, upscaler.run(frame.pixels));
+    return true;
+  }
 
-    // NR14: Frequency High + Trigger (0x80)
-    apu.write_byte(0xFF14, 0x80 | ((n.frequency >> 8) & 0x07));
+  bool any = false;
+  for (int y = 0; y < FrameExchange::HEIGHT;) {
+    if (!all && !frame.changed[y]) {
+      y++;
+      continue;
+    }
+    int end = y + 1;
+    while (end < FrameExchange::HEIGHT && (all || frame.changed[end]))
+      end++;
+    Rectangle rows = {0, float(y), float(FrameExchange::WIDTH),
+                      float(end - y)};
+    UpdateTextureRec(screen, rows, &frame.pixels[y * FrameExchange::WIDTH]);
+    any = true;
+    y = end;
   }
+  return any;
 }
 
 // ============================================================================
 // MAIN
 // ============================================================================
-int main() {
-  InitWindow(400, 300, "Tetris Theme Test");
+// Usage: Game [options]
+//   --upscale SPEC     Upscaler chain for the LCD (default scale2x, see
+//                      upscale.cpp), "" for none
+//   --capture PREFIX   Record the LCD to PREFIX.y4m and the audio output
+//                      to PREFIX.wav (see capture.cpp)
+int main(int argc, char **argv) {
+  const char *chain = "scale2x";
+  const char *capture_prefix = nullptr;
+  for (int i = 1; i < argc; i++) {
+    if (!std::strcmp(argv[i], "--upscale") && i + 1 < argc) {
+      chain = argv[++i];
+    } else if (!std::strcmp(argv[i], "--capture") && i + 1 < argc) {
+      capture_prefix = argv[++i];
+    } else {
+      std::cerr << "Unknown option: " << argv[i] << std::endl;
+      return 1;
+    }
+  }
+  if (!upscaler.configure(chain, LCD::SCREEN_WIDTH, LCD::SCREEN_HEIGHT)) {
+    std::cerr << upscaler.error << std::endl;
+    return 1;
+  }
+  ghosting = std::any_of(upscaler.stages.begin(), upscaler.stages.end(),
+                         [](const Upscaler::Stage &stage) {
+                           return stage.type == Upscaler::Ghost;
+                         });
+
+  if (capture_prefix) {
+    std::string prefix = capture_prefix;
+    if (!capture.open((prefix + ".y4m").c_str(), CaptureWriter::Y4M,
+                      (prefix + ".wav").c_str(), SAMPLE_RATE)) {
+      std::cerr << capture.error << std::endl;
+      return 1;
+    }
+  }
+
+  // The LCD goes right of the visualizer, at the chain's output size
+  InitWindow(std::max(580, 420 + upscaler.out_width),
+             std::max(300, 62 + upscaler.out_height), "Tetris Theme Test");
   InitAudioDevice();
   SetTargetFPS(60);
 
@@ -110,33 +250,64 @@ int main() {
   apu.write_byte(0xFF26, 0x80); // Power On
   apu.write_byte(0xFF25, 0x11); // Pan Ch1 to Left & Right (Bit 0 and 4)
   apu.write_byte(0xFF24, 0x77); // Master Vol Max
+  apu.set_sample_rate(APU_RATE);
+  apu.enable_blep(APU_RATE); // Band-limited output instead of sampling
+  resampler.set_rates(APU_RATE, SAMPLE_RATE);
+
+  // The melody is sequenced in emulated cycles and played by the APU
+  // itself, so note timing doesn't follow the window's frame pacing
+  sequencer.patterns = {{tetris_melody}};
+  sequencer.set_track(TETRIS_LEAD, {0});
+  sequencer.start(0);
+  apu.event_source = &sequencer;
+  apu.scope_enabled = true;
+  spectrum.sample_rate = float(APU::CLOCK_RATE) / APU::SCOPE_PERIOD;
 
-  AudioStream stream = LoadAudioStream(SAMPLE_RATE, 32, 2);
+  // Rate control keeps the pipeline fed, so a small buffer is enough
+  SetAudioStreamBufferSizeDefault(1024);
+  AudioStream stream = LoadAudioStream(SAMPLE_RATE, 16, 2);
   SetAudioStreamCallback(stream, GameAudioCallback);
   PlayAudioStream(stream);
 
+  // Framebuffer pixels are RGBA bytes, the texture's own layout
+  Image blank = GenImageColor(upscaler.out_width, upscaler.out_height, WHITE);
+  screen = LoadTextureFromImage(blank);
+  UnloadImage(blank);
+  frame_exchange.attach(lcd);
+  lcd.write_lcdc(0x91); // LCD and BG on, tiles at 8000
+
   while (!WindowShouldClose()) {
 
-    // Run our fake "Sound Engine" once per frame (60Hz)
-    UpdateMusic();
+    AdvanceGameClock();
+    ReadScope();
+    RunVideoFrame();
+    UpdateScreen();
 
     BeginDrawing();
     ClearBackground(RAYWHITE);
-    DrawText("Playing: Tetris Theme (Korobeiniki)", 20, 100, 20, DARKGRAY);
-    DrawText("Channel 1: Square Wave 50%", 20, 130, 10, GRAY);
-
-    // Visualizer bar based on current frequency
-    if (current_note_index > 0) {
-      int freq = tetris_melody[current_note_index - 1].frequency;
-      if (freq > 0) {
-        float height = (freq - 1300) / 2.0f;
-        DrawRectangle(150, 200 - height, 50, height, RED);
-      }
-    }
+    DrawText("Playing: Tetris Theme (Korobeiniki)", 20, 10, 20, DARKGRAY);
+    DrawText("Channel 1: Square Wave 50%", 20, 35, 10, GRAY);
+
+    const Color TRACE_COLORS[5] = {RED, ORANGE, GREEN, BLUE, DARKGRAY};
+    for (int trace = 0; trace < 5; trace++)
+      DrawScope(trace, 20, 52 + trace * 32, 28, TRACE_COLORS[trace]);
+    DrawSpectrum(20, 220, SCOPE_WIDTH, 70);
+    DrawText("LCD", 400, 35, 10, GRAY);
+    DrawTexture(screen, 400, 52, WHITE);
     EndDrawing();
   }
 
+  UnloadTexture(screen);
   CloseAudioDevice();
+  if (capture.is_open()) { // Audio thread stopped, so it can close
+    capture.close();
+    std::cout << "Captured " << capture.frames_written << " frames ("
+              << capture.frames_repeated << " repeated, "
+              << capture.frames_replaced << " replaced, "
+              << capture.frames_dropped << " dropped), "
+              << capture.samples_written << " samples ("
+              << capture.samples_dropped << " dropped)" << std::endl;
+  }
   CloseWindow();
   return 0;
 }
@@ -0,0 +1,83 @@
+// The test melody and the register writes that play it. Shared by the
+// raylib frontend and the headless tools.
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// ============================================================================
+// HELPER: NOTE FREQUENCIES
+// These are the raw 11-bit values the Game Boy uses for notes
+// Formula: x = 2048 - (131072 / Frequency)
+// ============================================================================
+const int NOTE_E5 = 1650;
+const int NOTE_B4 = 1546;
+const int NOTE_C5 = 1576;
+const int NOTE_D5 = 1602;
+const int NOTE_A4 = 1496;
+const int NOTE_G4 = 1428;
+const int NOTE_F4 = 1360; // Approximate
+
+struct Note {
+  int frequency; // The raw 11-bit value
+  int duration;  // In video frames (70224 cycles, about 1/60 s)
+};
+
+// THE TETRIS THEME (Korobeiniki)
+// Melody: E -> B -> C -> D -> C -> B -> A ...
+std::vector<Note> tetris_melody = {
+    {NOTE_E5, 20}, {NOTE_B4, 10}, {NOTE_C5, 10}, {NOTE_D5, 20}, {NOTE_C5, 10},
+    {NOTE_B4, 10}, {NOTE_A4, 20}, {NOTE_A4, 10}, {NOTE_C5, 10}, {NOTE_E5, 20},
+    {NOTE_D5, 10}, {NOTE_C5, 10}, {NOTE_B4, 30}, {NOTE_C5, 10}, {NOTE_D5, 20},
+    {NOTE_E5, 20}, {NOTE_C5, 20}, {NOTE_A4, 20}, {NOTE_A4, 40}, {0, 10}, // Rest
+    {NOTE_D5, 20}, {NOTE_F4, 10}, {NOTE_A4, 20}, {NOTE_G4, 10}, {NOTE_F4, 10},
+    {NOTE_E5, 30}, {NOTE_C5, 10}, {NOTE_E5, 20}, {NOTE_D5, 10}, {NOTE_C5, 10},
+    {NOTE_B4, 20}, {NOTE_B4, 10}, {NOTE_C5, 10}, {NOTE_D5, 20}, {NOTE_E5, 20},
+    {NOTE_C5, 20}, {NOTE_A4, 20}, {NOTE_A4, 40}};
+
+// How a channel plays its notes: the register values written along with
+// every note. Channels are numbered 1-4 like in the docs.
+struct Instrument {
+  int channel;
+  uint8_t nrx0; // Ch1: sweep. Ch3: 0x80 turns the DAC on
+  uint8_t nrx1; // Duty and length
+  uint8_t nrx2; // Envelope. Ch3: output level
+};
+
+// NR12: Volume 10 (0xA), Decay (0), Speed 2
+// This gives it that "plucky" Game Boy sound
+const Instrument TETRIS_LEAD = {1, 0x00, 0x80, 0xA2};
+
+// Issues the register writes that start note `n` with `instrument`
+// through write(uint16_t addr, uint8_t value). Frequency is the raw
+// 11-bit value, or the NR43 value on the noise channel; 0 is a rest.
+template <typename Write>
+void play_note(const Instrument &instrument, const Note &n, Write &&write) {
+  // NRx0-NRx4 are five registers apart for every channel
+  uint16_t base = 0xFF10 + 5 * (instrument.channel - 1);
+
+  if (n.frequency == 0) {
+    // Rest (Silence)
+    if (instrument.channel == 3) {
+      write(0xFF1A, 0x00); // DAC off
+    } else {
+      // We set volume to 0 (Envelope 0, Direction 0)
+      write(base + 2, 0x00);
+      write(base + 4, 0x80); // Trigger to apply
+    }
+    return;
+  }
+
+  if (instrument.channel == 1 || instrument.channel == 3)
+    write(base, instrument.nrx0);
+  write(base + 1, instrument.nrx1);
+  write(base + 2, instrument.nrx2);
+  if (instrument.channel == 4) {
+    write(base + 3, n.frequency & 0xFF); // NR43: clock shift, width, divisor
+    write(base + 4, 0x80);
+  } else {
+    // Frequency Low Byte, then High + Trigger (0x80)
+    write(base + 3, n.frequency & 0xFF);
+    write(base + 4, 0x80 | ((n.frequency >> 8) & 0x07));
+  }
+}
@@ -0,0 +1,216 @@
+// Headless audio renderer. Drives the APU from a register write script,
+// or the built-in Tetris melody, as fast as the CPU allows and writes the
+// result to a WAV file. No window or audio device is opened, so it works
+// for rendering music offline and for timing the audio core.
+//
+// Usage: AudioRender [options]
+//   -o FILE        Output WAV file (default out.wav, "-" renders only)
+//   --script FILE  Register writes, one per line: <cycle> <addr> <value>
+//                  with the cycle in decimal and addr/value in hex.
+//                  Lines starting with '#' are comments.
+//   --loops N      Times to play the built-in melody (default 1)
+//   --rate HZ      Output sample rate (default 48000)
+//   --float        Write 32-bit float samples instead of 16-bit PCM
+//   --point        Point sample the channels instead of BLEP synthesis
+//   --int          Mix and resample in integers (render_s16), as the
+//                  frontend does
+//   --tail SEC     Seconds to keep rendering after the script (default 1)
+
+#include "audio.cpp"
+#include "music.cpp"
+#include "resampler.cpp"
+#include "sequencer.cpp"
+#include "wav.cpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+const int APU_RATE = APU::CLOCK_RATE / 64; // Whole cycles per sample
+
+APU apu;
+Resampler resampler;
+Sequencer sequencer;
+std::vector<APU::RegisterWrite> script; // From --script
+std::size_t next_write = 0;             // First one not yet posted
+
+void apu_render(float *out, std::size_t frames) { apu.render(out, frames); }
+void apu_render(int16_t *out, std::size_t frames) {
+  apu.render_s16(out, frames);
+}
+
+// Renders `frames` APU samples, posting script writes as the queue makes
+// room. With writes left over it stops at the first of them, which the
+// queue applies at its exact cycle once posted, rather than late.
+template <typename Sample> void render_script(Sample *out, std::size_t frames) {
+  while (frames > 0) {
+    while (next_write < script.size() &&
+           apu.post_write(script[next_write].cycle, script[next_write].addr,
+                          script[next_write].value))
+      next_write++;
+    std::size_t count = frames;
+    if (next_write < script.size())
+      count = std::min(count, apu.samples_until(script[next_write].cycle));
+    apu_render(out, count);
+    out += count * 2;
+    frames -= count;
+  }
+}
+
+// Plays the melody the way main.cpp does, through the sequencer.
+// Returns the cycle the last note ends on.
+uint64_t start_melody(int loops) {
+  apu.write_byte(0xFF26, 0x80); // Power On
+  apu.write_byte(0xFF25, 0x11); // Pan Ch1 to Left & Right
+  apu.write_byte(0xFF24, 0x77); // Master Vol Max
+  if (loops == 0)
+    return 0;
+  sequencer.patterns = {{tetris_melody}};
+  sequencer.set_track(TETRIS_LEAD, {0});
+  sequencer.start(0, loops);
+  apu.event_source = &sequencer;
+  return sequencer.length() * loops;
+}
+
+// Returns the cycle of the last write, or -1 if the file can't be read
+long long load_script(const char *path,
+                      std::vector<APU::RegisterWrite> &script) {
+  std::FILE *file = std::fopen(path, "r");
+  if (!file)
+    return -1;
+
+  char line[256];
+  unsigned long long cycle = 0;
+  unsigned long long last = 0;
+  int line_number = 0;
+  while (std::fgets(line, sizeof(line), file)) {
+    line_number++;
+    if (line[0] == '#' || line[0] == '\n' || line[0] == '\r')
+      continue;
+    unsigned int addr, value;
+    if (std::sscanf(line, "%llu %x %x", &cycle, &addr, &value) != 3) {
+      std::fprintf(stderr, "%s:%d: expected <cycle> <addr> <value>\n", path,
+                   line_number);
+      continue;
+    }
+    if (cycle < last) {
+      std::fprintf(stderr, "%s:%d: writes must be in cycle order\n", path,
+                   line_number);
+      continue;
+    }
+    script.push_back({cycle, uint16_t(addr), uint8_t(value)});
+    last = cycle;
+  }
+  std::fclose(file);
+  return static_cast<long long>(last);
+}
+
+int main(int argc, char **argv) {
+  const char *output = "out.wav";
+  const char *script_path = nullptr;
+  int loops = 1;
+  int rate = 48000;
+  double tail = 1.0;
+  bool use_float = false;
+  bool use_blep = true;
+  bool use_int = false;
+
+  for (int i = 1; i < argc; i++) {
+    bool has_value = i + 1 < argc;
+    if (!std::strcmp(argv[i], "-o") && has_value)
+      output = argv[++i];
+    else if (!std::strcmp(argv[i], "--script") && has_value)
+      script_path = argv[++i];
+    else if (!std::strcmp(argv[i], "--loops") && has_value)
+      loops = std::atoi(argv[++i]);
+    else if (!std::strcmp(argv[i], "--rate") && has_value)
+      rate = std::atoi(argv[++i]);
+    else if (!std::strcmp(argv[i], "--tail") && has_value)
+      tail = std::atof(argv[++i]);
+    else if (!std::strcmp(argv[i], "--float"))
+      use_float = true;
+    else if (!std::strcmp(argv[i], "--point"))
+      use_blep = false;
+    else if (!std::strcmp(argv[i], "--int"))
+      use_int = true;
+    else {
+      std::fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      return 1;
+    }
+  }
+  if (rate <= 0 || loops < 0 || tail < 0) {
+    std::fprintf(stderr, "Invalid --rate, --loops or --tail\n");
+    return 1;
+  }
+
+  uint64_t end_cycle;
+  if (script_path) {
+    long long last = load_script(script_path, script);
+    if (last < 0) {
+      std::fprintf(stderr, "Can't read %s\n", script_path);
+      return 1;
+    }
+    end_cycle = static_cast<uint64_t>(last);
+  } else {
+    end_cycle = start_melody(loops);
+  }
+  end_cycle += static_cast<uint64_t>(tail * APU::CLOCK_RATE);
+
+  WavWriter wav;
+  bool write_file = std::strcmp(output, "-") != 0;
+  if (write_file && !wav.open(output, rate, 2,
+                              use_float ? WavWriter::Float32
+                                        : WavWriter::PCM16)) {
+    std::fprintf(stderr, "Can't write %s\n", output);
+    return 1;
+  }
+
+  apu.set_sample_rate(APU_RATE);
+  if (use_blep)
+    apu.enable_blep(APU_RATE);
+  resampler.set_rates(APU_RATE, rate);
+
+  const std::size_t BLOCK = 4096;
+  std::vector<float> buffer(BLOCK * 2);
+  std::vector<int16_t> buffer_s16(BLOCK * 2);
+  std::size_t total = static_cast<std::size_t>(
+      double(end_cycle) * rate / APU::CLOCK_RATE + 0.5);
+  double render_seconds = 0.0;
+
+  for (std::size_t done = 0; done < total;) {
+    std::size_t frames = (total - done) < BLOCK ? (total - done) : BLOCK;
+    auto start = std::chrono::steady_clock::now();
+    if (use_int && rate == APU_RATE)
+      render_script(buffer_s16.data(), frames);
+    else if (use_int)
+      resampler.process(
+          buffer_s16.data(), frames,
+          [](int16_t *out, std::size_t n) { render_script(out, n); });
+    else if (rate == APU_RATE)
+      render_script(buffer.data(), frames);
+    else
+      resampler.process(buffer.data(), frames, [](float *out, std::size_t n) {
+        render_script(out, n);
+      });
+    render_seconds += std::chrono::duration<double>(
+                          std::chrono::steady_clock::now() - start)
+                          .count();
+
+    if (write_file && use_int)
+      wav.write(buffer_s16.data(), frames);
+    else if (write_file)
+      wav.write(buffer.data(), frames);
+    done += frames;
+  }
+  wav.close();
+
+  double audio_seconds = double(total) / rate;
+  std::printf("Rendered %zu frames (%.2f s of audio) in %.3f s\n", total,
+              audio_seconds, render_seconds);
+  if (render_seconds > 0.0)
+    std::printf("%.0f samples/s, %.1fx realtime\n", total / render_seconds,
+                audio_seconds / render_seconds);
+  return 0;
+}
@@ -0,0 +1,226 @@
+// Converts the APU's output to whatever rate the audio device runs at.
+// The APU renders at a rate that divides the master clock exactly (so
+// there is no integer-division pitch error), and this stage takes it to
+// 44.1k/48k/96k through a windowed sinc interpolator. The conversion ratio
+// is fractional and can be nudged while playing (dynamic rate control),
+// which lets the frontend hold its buffers at a fixed latency.
+// Input and output are interleaved stereo, either float or int16; one
+// Resampler should only be fed one of the two.
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+class Resampler {
+public:
+  static constexpr int TAPS = 16;     // Input samples per output sample
+  static constexpr int PHASES = 64;   // Kernel rows, interpolated between
+  static constexpr int BLOCK = 512;   // Input frames pulled at once
+  static constexpr int PHASE_BITS = 32; // Fixed point phase, see `phase`
+  static constexpr int COEF_BITS = 14;  // int16 kernel, rows sum to 1 << 14
+
+  Resampler() {
+    base_step = 1.0;
+    step = ONE;
+    adjust = 1.0;
+    phase = 0;
+    input_pos = 0;
+    input_count = 0;
+    history_pos = 0;
+    std::memset(history, 0, sizeof(history));
+    std::memset(history_s16, 0, sizeof(history_s16));
+    build_kernel(1.0);
+  }
+
+  void set_rates(double input_rate, double output_rate) {
+    base_step = input_rate / output_rate;
+    update_step();
+    // Downsampling has to cut below the new Nyquist as well
+    double cutoff = (output_rate < input_rate) ? output_rate / input_rate : 1.0;
+    build_kernel(cutoff);
+  }
+
+  // Scales the conversion ratio, e.g. 1.002 consumes input 0.2% faster.
+  // Small enough changes don't need a new kernel.
+  void set_adjust(double value) {
+    adjust = value;
+    update_step();
+  }
+
+  double get_adjust() const { return adjust; }
+
+  // Writes `frames` interleaved stereo frames to `out`, pulling input
+  // through source(float *buffer, std::size_t frames) as needed.
+  template <typename Source>
+  void process(float *out, std::size_t frames, Source &&source) {
+    for (std::size_t i = 0; i < frames; i++) {
+      while (phase >= ONE) {
+        if (input_pos == input_count) {
+          source(input, static_cast<std::size_t>(BLOCK));
+          input_pos = 0;
+          input_count = BLOCK;
+        }
+        push(input[input_pos * 2], input[input_pos * 2 + 1]);
+        input_pos++;
+        phase -= ONE;
+      }
+
+      int row = static_cast<int>(phase >> ROW_SHIFT);
+      float frac = (phase & ROW_MASK) * (1.0f / (ROW_MASK + 1));
+      const float *k0 = kernel[row];
+      const float *k1 = kernel[row + 1];
+      const float *left = &history[0][history_pos];
+      const float *right = &history[1][history_pos];
+
+      float sum_left = 0.0f;
+      float sum_right = 0.0f;
+      for (int k = 0; k < TAPS; k++) {
+        float c = k0[k] + (k1[k] - k0[k]) * frac;
+        sum_left += left[k] * c;
+        sum_right += right[k] * c;
+      }
+      out[i * 2] = sum_left;
+      out[i * 2 + 1] = sum_right;
+      phase += step;
+    }
+  }
+
+  // Integer version, pulling through source(int16_t *buffer, frames).
+  // Kernel rows are interpolated with FRAC_BITS of the phase and the taps
+  // summed in 32 bits, which the COEF_BITS kernel keeps from overflowing.
+  template <typename Source>
+  void process(int16_t *out, std::size_t frames, Source &&source) {
+    for (std::size_t i = 0; i < frames; i++) {
+      while (phase >= ONE) {
+        if (input_pos == input_count) {
+          source(input_s16, static_cast<std::size_t>(BLOCK));
+          input_pos = 0;
+          input_count = BLOCK;
+        }
+        push_s16(input_s16[input_pos * 2], input_s16[input_pos * 2 + 1]);
+        input_pos++;
+        phase -= ONE;
+      }
+
+      int row = static_cast<int>(phase >> ROW_SHIFT);
+      int32_t frac = static_cast<int32_t>((phase & ROW_MASK) >>
+                                          (ROW_SHIFT - FRAC_BITS));
+      const int16_t *k0 = kernel_s16[row];
+      const int16_t *k1 = kernel_s16[row + 1];
+      const int16_t *left = &history_s16[0][history_pos];
+      const int16_t *right = &history_s16[1][history_pos];
+
+      int32_t sum_left = 0;
+      int32_t sum_right = 0;
+      for (int k = 0; k < TAPS; k++) {
+        int32_t c = k0[k] + (((k1[k] - k0[k]) * frac) >> FRAC_BITS);
+        sum_left += left[k] * c;
+        sum_right += right[k] * c;
+      }
+      out[i * 2] = clamp_s16(sum_left);
+      out[i * 2 + 1] = clamp_s16(sum_right);
+      phase += step;
+    }
+  }
+
+private:
+  static constexpr uint64_t ONE = uint64_t(1) << PHASE_BITS;
+  static constexpr int ROW_SHIFT = PHASE_BITS - 6; // log2(PHASES)
+  static constexpr uint64_t ROW_MASK = (uint64_t(1) << ROW_SHIFT) - 1;
+  static constexpr int FRAC_BITS = 15; // Row interpolation, integer path
+
+  double base_step; // Input frames per output frame
+  double adjust;
+  uint64_t step;    // base_step * adjust, PHASE_BITS fixed point
+  uint64_t phase;   // Output position past the centre of the window
+
+  float input[BLOCK * 2];
+  int16_t input_s16[BLOCK * 2];
+  int input_pos;
+  int input_count;
+
+  // Last TAPS input frames per side, stored twice so the window starting
+  // at history_pos is always contiguous.
+  float history[2][TAPS * 2];
+  int16_t history_s16[2][TAPS * 2];
+  int history_pos;
+
+  float kernel[PHASES + 1][TAPS];
+  int16_t kernel_s16[PHASES + 1][TAPS];
+
+  void update_step() {
+    step = static_cast<uint64_t>(base_step * adjust * ONE + 0.5);
+  }
+
+  void push(float left, float right) {
+    history[0][history_pos] = history[0][history_pos + TAPS] = left;
+    history[1][history_pos] = history[1][history_pos + TAPS] = right;
+    history_pos = (history_pos + 1) % TAPS;
+  }
+
+  void push_s16(int16_t left, int16_t right) {
+    history_s16[0][history_pos] = history_s16[0][history_pos + TAPS] = left;
+    history_s16[1][history_pos] = history_s16[1][history_pos + TAPS] = right;
+    history_pos = (history_pos + 1) % TAPS;
+  }
+
+  static int16_t clamp_s16(int32_t sum) {
+    sum = (sum + (1 << (COEF_BITS - 1))) >> COEF_BITS;
+    if (sum > 32767)
+      return 32767;
+    if (sum < -32768)
+      return -32768;
+    return static_cast<int16_t>(sum);
+  }
+
+  // Blackman windowed sinc, one row per sub-sample phase, each row
+  // normalised to unit DC gain.
+  void build_kernel(double cutoff) {
+    const double pi = 3.14159265358979323846;
+    cutoff *= 0.9;
+    for (int p = 0; p <= PHASES; p++) {
+      double taps[TAPS];
+      double total = 0.0;
+      for (int k = 0; k < TAPS; k++) {
+        double t = k - (TAPS / 2 - 1) - double(p) / PHASES;
+        double x = pi * cutoff * t;
+        double sinc = (t == 0.0) ? 1.0 : std::sin(x) / x;
+        double w = (t + TAPS / 2) / TAPS;
+        double window =
+            0.42 - 0.5 * std::cos(2 * pi * w) + 0.08 * std::cos(4 * pi * w);
+        taps[k] = sinc * window;
+        total += taps[k];
+      }
+      for (int k = 0; k < TAPS; k++) {
+        kernel[p][k] = static_cast<float>(taps[k] / total);
+        kernel_s16[p][k] = static_cast<int16_t>(
+            std::lround(taps[k] / total * (1 << COEF_BITS)));
+      }
+    }
+  }
+};
+
+// Dynamic rate control. Turns a fill reading (how much input is queued
+// ahead of the consumer) into a Resampler adjust factor: consume a little
+// faster when the queue runs ahead of the target, a little slower when it
+// drains. The limit keeps the pitch change inaudible.
+class RateControl {
+public:
+  double max_delta = 0.005; // At most +/-0.5% speed change
+  double smoothing = 0.05;  // Fraction of the error corrected per update
+
+  double update(double fill, double target) {
+    double error = (fill - target) / target;
+    if (error > 1.0)
+      error = 1.0;
+    if (error < -1.0)
+      error = -1.0;
+    adjust += (1.0 + error * max_delta - adjust) * smoothing;
+    return adjust;
+  }
+
+private:
+  double adjust = 1.0;
+};
@@ -0,0 +1,153 @@
+// Music sequencer that runs inside the APU. Notes are scheduled in
+// emulated cycles and written from APU::tick() exactly when they are due,
+// so the timing doesn't depend on the frame rate, frame pacing or how the
+// audio happens to be rendered.
+//
+// Songs are built from patterns (lists of notes) and one track per
+// channel, each playing an order list of patterns and looping on its own.
+#pragma once
+
+#include "audio.cpp"
+#include "music.cpp"
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+class Sequencer : public APU::EventSource {
+public:
+  // One DMG video frame (154 lines of 456 cycles, 59.73Hz). Note
+  // durations count these.
+  static constexpr uint64_t CYCLES_PER_FRAME = 70224;
+  static constexpr int MAX_TRACKS = 4; // One per channel
+
+  struct Pattern {
+    std::vector<Note> notes;
+  };
+  std::vector<Pattern> patterns;
+
+  // Plays `order` (indices into patterns) on instrument.channel. At the
+  // end of the order the track jumps back to order[loop_to], or stops if
+  // loop_to is -1. Replaces any track already on that channel.
+  void set_track(const Instrument &instrument, std::vector<int> order,
+                 int loop_to = 0) {
+    Track &t = tracks[instrument.channel - 1];
+    t.used = true;
+    t.active = false;
+    t.instrument = instrument;
+    t.order = std::move(order);
+    t.loop_to = (loop_to >= 0 && std::size_t(loop_to) < t.order.size())
+                    ? loop_to
+                    : -1;
+  }
+
+  void clear_tracks() {
+    for (Track &t : tracks)
+      t.used = t.active = false;
+    next_cycle = UINT64_MAX;
+  }
+
+  // Starts every track at `cycle`. Each plays `passes` times through its
+  // order (0 loops forever) and then goes quiet. Call while the APU isn't
+  // ticking, e.g. before attaching it as the APU's event_source.
+  void start(uint64_t cycle, int passes = 0) {
+    for (Track &t : tracks) {
+      t.active = t.used;
+      t.order_pos = 0;
+      t.note_pos = 0;
+      t.passes_left = passes;
+      t.next_cycle = cycle;
+      t.loop_cycle = cycle;
+    }
+    update_next_cycle();
+  }
+
+  bool playing() const { return next_cycle != UINT64_MAX; }
+
+  // Cycles the first pass of the longest track takes
+  uint64_t length() const {
+    uint64_t longest = 0;
+    for (const Track &t : tracks) {
+      if (!t.used)
+        continue;
+      uint64_t frames = 0;
+      for (int index : t.order)
+        if (index >= 0 && std::size_t(index) < patterns.size())
+          for (const Note &n : patterns[index].notes)
+            frames += n.duration;
+      if (frames * CYCLES_PER_FRAME > longest)
+        longest = frames * CYCLES_PER_FRAME;
+    }
+    return longest;
+  }
+
+  void run(APU &apu) override {
+    uint64_t now = next_cycle;
+    auto write = [&](uint16_t addr, uint8_t value) {
+      apu.write_byte(addr, value);
+    };
+
+    for (Track &t : tracks) {
+      while (t.active && t.next_cycle <= now) {
+        const Note *n = next_note(t);
+        if (!n) {
+          play_note(t.instrument, Note{0, 0}, write);
+          t.active = false;
+          break;
+        }
+        play_note(t.instrument, *n, write);
+        t.next_cycle += uint64_t(n->duration) * CYCLES_PER_FRAME;
+      }
+    }
+    update_next_cycle();
+  }
+
+private:
+  struct Track {
+    bool used = false;
+    bool active = false;
+    Instrument instrument = {};
+    std::vector<int> order;
+    int loop_to = -1;
+
+    std::size_t order_pos = 0;
+    std::size_t note_pos = 0;
+    int passes_left = 0;      // 0 plays forever
+    uint64_t next_cycle = 0;  // When the next note starts
+    uint64_t loop_cycle = 0;  // When the current pass started
+  };
+  Track tracks[MAX_TRACKS];
+
+  // Moves on to the next note of `t`, or returns nullptr when the track
+  // has played its last pass.
+  const Note *next_note(Track &t) {
+    while (true) {
+      if (t.order_pos >= t.order.size()) {
+        // A pass with no length would loop here forever
+        bool last = t.passes_left == 1 || t.loop_to < 0 ||
+                    t.next_cycle == t.loop_cycle;
+        if (t.passes_left > 0)
+          t.passes_left--;
+        if (last)
+          return nullptr;
+        t.order_pos = t.loop_to;
+        t.note_pos = 0;
+        t.loop_cycle = t.next_cycle;
+        continue;
+      }
+      int index = t.order[t.order_pos];
+      if (index >= 0 && std::size_t(index) < patterns.size() &&
+          t.note_pos < patterns[index].notes.size())
+        return &patterns[index].notes[t.note_pos++];
+      t.order_pos++;
+      t.note_pos = 0;
+    }
+  }
+
+  void update_next_cycle() {
+    next_cycle = UINT64_MAX;
+    for (const Track &t : tracks)
+      if (t.active && t.next_cycle < next_cycle)
+        next_cycle = t.next_cycle;
+  }
+};
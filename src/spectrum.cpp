@@ -0,0 +1,102 @@
+// Spectrum analyser for the visualizer. Collects the mixed output read
+// from APU::scope on the render thread and turns the latest SIZE samples
+// into a magnitude spectrum with a windowed radix-2 FFT, so none of the
+// work happens on the audio thread.
+#pragma once
+
+#include <cmath>
+#include <complex>
+#include <cstddef>
+
+class Spectrum {
+public:
+  static constexpr int SIZE = 1024; // FFT length, a power of two
+  static constexpr int BINS = SIZE / 2;
+
+  float sample_rate = 32768.0f; // Rate of the pushed samples
+  float magnitude[BINS];        // dB relative to full scale, from compute()
+
+  Spectrum() {
+    const double pi = 3.14159265358979323846;
+    for (int i = 0; i < SIZE; i++) {
+      window[i] = static_cast<float>(0.5 - 0.5 * std::cos(2 * pi * i / SIZE));
+      history[i] = 0.0f;
+    }
+    for (int i = 0; i < SIZE / 2; i++)
+      twiddle[i] = std::polar(1.0f, static_cast<float>(-2 * pi * i / SIZE));
+    for (int i = 0; i < BINS; i++)
+      magnitude[i] = -120.0f;
+    history_pos = 0;
+  }
+
+  // One mono sample in [-1, 1]
+  void push(float sample) {
+    history[history_pos] = sample;
+    history_pos = (history_pos + 1) & (SIZE - 1);
+  }
+
+  // Transforms the last SIZE samples into magnitude[]
+  void compute() {
+    // Oldest sample first, windowed, in bit-reversed order
+    float mean = 0.0f;
+    for (int i = 0; i < SIZE; i++)
+      mean += history[i];
+    mean /= SIZE; // The APU output is unipolar, drop its DC offset
+    for (int i = 0; i < SIZE; i++) {
+      float x = history[(history_pos + i) & (SIZE - 1)] - mean;
+      data[reverse_bits(i)] = x * window[i];
+    }
+
+    for (int length = 2; length <= SIZE; length <<= 1) {
+      int half = length / 2;
+      int stride = SIZE / length;
+      for (int start = 0; start < SIZE; start += length) {
+        for (int k = 0; k < half; k++) {
+          std::complex<float> even = data[start + k];
+          std::complex<float> odd =
+              data[start + k + half] * twiddle[k * stride];
+          data[start + k] = even + odd;
+          data[start + k + half] = even - odd;
+        }
+      }
+    }
+
+    // A full scale sine gives SIZE/4 through the Hann window
+    const float scale = 4.0f / SIZE;
+    for (int i = 0; i < BINS; i++) {
+      float m = std::abs(data[i]) * scale;
+      magnitude[i] = 20.0f * std::log10(m + 1e-6f);
+    }
+  }
+
+  // Peak dB over the bins between two frequencies, for bar displays
+  float band(float low_hz, float high_hz) const {
+    int low = static_cast<int>(low_hz * SIZE / sample_rate);
+    int high = static_cast<int>(high_hz * SIZE / sample_rate);
+    if (low < 1)
+      low = 1;
+    if (high >= BINS)
+      high = BINS - 1;
+    float peak = -120.0f;
+    for (int i = low; i <= high; i++)
+      if (magnitude[i] > peak)
+        peak = magnitude[i];
+    return peak;
+  }
+
+private:
+  float window[SIZE];
+  float history[SIZE];
+  int history_pos;
+  std::complex<float> twiddle[SIZE / 2];
+  std::complex<float> data[SIZE];
+
+  static int reverse_bits(int i) {
+    int r = 0;
+    for (int bit = 1; bit < SIZE; bit <<= 1) {
+      r = (r << 1) | (i & 1);
+      i >>= 1;
+    }
+    return r;
+  }
+};
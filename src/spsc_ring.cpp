@@ -0,0 +1,61 @@
+// Single-producer / single-consumer ring buffer.
+// One thread pushes, one thread pops, and neither ever blocks or takes a
+// lock, so it is safe to use from the real-time audio callback.
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+template <typename T, std::size_t Capacity> class SpscRing {
+  static_assert((Capacity & (Capacity - 1)) == 0,
+                "Capacity must be a power of two");
+
+public:
+  // Producer side. Returns false (and drops the item) when full.
+  bool push(const T &item) {
+    std::size_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) == Capacity)
+      return false;
+    items[h & (Capacity - 1)] = item;
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side. Returns the oldest item without removing it, or
+  // nullptr when empty.
+  const T *peek() const {
+    std::size_t t = tail.load(std::memory_order_relaxed);
+    if (t == head.load(std::memory_order_acquire))
+      return nullptr;
+    return &items[t & (Capacity - 1)];
+  }
+
+  // Consumer side. Only valid after peek() returned an item.
+  void pop() {
+    tail.store(tail.load(std::memory_order_relaxed) + 1,
+               std::memory_order_release);
+  }
+
+  bool pop(T &out) {
+    const T *item = peek();
+    if (!item)
+      return false;
+    out = *item;
+    pop();
+    return true;
+  }
+
+  // Approximate from any thread, exact from either end.
+  std::size_t size() const {
+    return head.load(std::memory_order_acquire) -
+           tail.load(std::memory_order_acquire);
+  }
+
+  static constexpr std::size_t capacity() { return Capacity; }
+
+private:
+  // Kept on separate cache lines so the two threads don't false-share
+  alignas(64) std::atomic<std::size_t> head{0};
+  alignas(64) std::atomic<std::size_t> tail{0};
+  alignas(64) T items[Capacity];
+};
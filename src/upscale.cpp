@@ -0,0 +1,496 @@
+// Post-processing for putting the LCD's 160x144 frames on big screens,
+// run on the CPU after the framebuffer so the GPU only has to draw an
+// unfiltered texture. A chain of stages, set up from a string such as
+// "ghost,scale2x,int2,grid":
+//
+//   ghost    LCD response: each frame is mixed 3:1 with the last output
+//   int2-6   Integer (nearest neighbour) scale
+//   scale2x  Scale2x / AdvMAME2x edge smoothing
+//   scale3x  Scale3x / AdvMAME3x
+//   grid     Darkens the right and bottom edge of every source pixel;
+//            the stages before it must scale by 3 or more
+//
+// The per-row kernels have SSE2/AVX2 versions picked at runtime, as in
+// PixelKernels.
+#pragma once
+
+#include "video.cpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// =============================================================
+// UpscaleKernels: one row at a time. Rows passed to the Scale2x
+// and Scale3x kernels have a valid pixel either side of them.
+// =============================================================
+struct UpscaleKernels {
+  // dst gets each of `width` pixels `factor` times
+  void (*scale_row)(const uint32_t *src, int width, int factor,
+                    uint32_t *dst);
+  // Two (three) output rows of twice (three times) the width
+  void (*scale2x_row)(const uint32_t *above, const uint32_t *row,
+                      const uint32_t *below, int width, uint32_t *out0,
+                      uint32_t *out1);
+  void (*scale3x_row)(const uint32_t *above, const uint32_t *row,
+                      const uint32_t *below, int width, uint32_t *out0,
+                      uint32_t *out1, uint32_t *out2);
+  // dst = 3/4 of src where mask is set, src elsewhere (keeps alpha)
+  void (*darken_row)(const uint32_t *src, const uint32_t *mask,
+                     uint32_t *dst, int count);
+  // dst = history = 3/4 cur + 1/4 history, per byte, rounding up
+  void (*ghost_row)(const uint32_t *cur, uint32_t *history, uint32_t *dst,
+                    int count);
+  const char *name;
+
+  static const UpscaleKernels &get() {
+    static const UpscaleKernels kernels = detect();
+    return kernels;
+  }
+
+  static const UpscaleKernels &scalar() {
+    static const UpscaleKernels kernels = {
+        scale_row_scalar, scale2x_row_scalar, scale3x_row_scalar,
+        darken_row_scalar, ghost_row_scalar, "scalar"};
+    return kernels;
+  }
+
+  static void scale_row_scalar(const uint32_t *src, int width, int factor,
+                               uint32_t *dst) {
+    for (int x = 0; x < width; x++)
+      for (int i = 0; i < factor; i++)
+        *dst++ = src[x];
+  }
+
+  static void scale2x_row_scalar(const uint32_t *above, const uint32_t *row,
+                                 const uint32_t *below, int width,
+                                 uint32_t *out0, uint32_t *out1) {
+    for (int x = 0; x < width; x++) {
+      uint32_t b = above[x], d = row[x - 1], e = row[x], f = row[x + 1];
+      uint32_t h = below[x];
+      bool edge = b != h && d != f;
+      out0[x * 2] = edge && d == b ? d : e;
+      out0[x * 2 + 1] = edge && b == f ? f : e;
+      out1[x * 2] = edge && d == h ? d : e;
+      out1[x * 2 + 1] = edge && h == f ? f : e;
+    }
+  }
+
+  static void scale3x_row_scalar(const uint32_t *above, const uint32_t *row,
+                                 const uint32_t *below, int width,
+                                 uint32_t *out0, uint32_t *out1,
+                                 uint32_t *out2) {
+    for (int x = 0; x < width; x++) {
+      uint32_t a = above[x - 1], b = above[x], c = above[x + 1];
+      uint32_t d = row[x - 1], e = row[x], f = row[x + 1];
+      uint32_t g = below[x - 1], h = below[x], i = below[x + 1];
+      uint32_t *o0 = &out0[x * 3], *o1 = &out1[x * 3], *o2 = &out2[x * 3];
+      o0[0] = o0[1] = o0[2] = o1[0] = o1[1] = o1[2] = e;
+      o2[0] = o2[1] = o2[2] = e;
+      if (b == h || d == f)
+        continue;
+      if (d == b)
+        o0[0] = d;
+      if ((d == b && e != c) || (b == f && e != a))
+        o0[1] = b;
+      if (b == f)
+        o0[2] = f;
+      if ((d == b && e != g) || (d == h && e != a))
+        o1[0] = d;
+      if ((b == f && e != i) || (h == f && e != c))
+        o1[2] = f;
+      if (d == h)
+        o2[0] = d;
+      if ((d == h && e != i) || (h == f && e != g))
+        o2[1] = h;
+      if (h == f)
+        o2[2] = f;
+    }
+  }
+
+  static uint32_t darken(uint32_t p) { return p - ((p >> 2) & 0x003F3F3F); }
+
+  static void darken_row_scalar(const uint32_t *src, const uint32_t *mask,
+                                uint32_t *dst, int count) {
+    for (int x = 0; x < count; x++)
+      dst[x] = mask[x] ? darken(src[x]) : src[x];
+  }
+
+  // Per byte (a + b + 1) / 2, as pavgb
+  static uint32_t average(uint32_t a, uint32_t b) {
+    return (a | b) - (((a ^ b) >> 1) & 0x7F7F7F7F);
+  }
+
+  static void ghost_row_scalar(const uint32_t *cur, uint32_t *history,
+                               uint32_t *dst, int count) {
+    for (int x = 0; x < count; x++)
+      dst[x] = history[x] = average(cur[x], average(cur[x], history[x]));
+  }
+
+#ifdef VIDEO_X86_DISPATCH
+  // Factor 2 interleaves a vector with itself, bigger factors store a
+  // broadcast of each pixel, overlapping the next pixel's run
+  __attribute__((target("sse2"))) static void
+  scale_row_sse2(const uint32_t *src, int width, int factor, uint32_t *dst) {
+    int x = 0;
+    if (factor == 2) {
+      for (; x + 4 <= width; x += 4) {
+        __m128i p = _mm_loadu_si128((const __m128i *)(src + x));
+        _mm_storeu_si128((__m128i *)(dst + x * 2), _mm_unpacklo_epi32(p, p));
+        _mm_storeu_si128((__m128i *)(dst + x * 2 + 4),
+                         _mm_unpackhi_epi32(p, p));
+      }
+    } else if (factor >= 3) {
+      for (; x + 1 < width; x++) { // The last pixel would overrun
+        __m128i p = _mm_set1_epi32(int(src[x]));
+        for (int i = 0; i < factor; i += 4)
+          _mm_storeu_si128((__m128i *)(dst + x * factor + i), p);
+      }
+    }
+    scale_row_scalar(src + x, width - x, factor, dst + x * factor);
+  }
+
+  __attribute__((target("sse2"))) static __m128i
+  select_sse2(__m128i mask, __m128i a, __m128i b) {
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+  }
+
+  __attribute__((target("sse2"))) static void
+  scale2x_row_sse2(const uint32_t *above, const uint32_t *row,
+                   const uint32_t *below, int width, uint32_t *out0,
+                   uint32_t *out1) {
+    int x = 0;
+    for (; x + 4 <= width; x += 4) {
+      __m128i b = _mm_loadu_si128((const __m128i *)(above + x));
+      __m128i d = _mm_loadu_si128((const __m128i *)(row + x - 1));
+      __m128i e = _mm_loadu_si128((const __m128i *)(row + x));
+      __m128i f = _mm_loadu_si128((const __m128i *)(row + x + 1));
+      __m128i h = _mm_loadu_si128((const __m128i *)(below + x));
+      __m128i edge = _mm_andnot_si128(
+          _mm_or_si128(_mm_cmpeq_epi32(b, h), _mm_cmpeq_epi32(d, f)),
+          _mm_set1_epi32(-1));
+      __m128i db = _mm_and_si128(edge, _mm_cmpeq_epi32(d, b));
+      __m128i bf = _mm_and_si128(edge, _mm_cmpeq_epi32(b, f));
+      __m128i dh = _mm_and_si128(edge, _mm_cmpeq_epi32(d, h));
+      __m128i hf = _mm_and_si128(edge, _mm_cmpeq_epi32(h, f));
+      __m128i e0 = select_sse2(db, d, e), e1 = select_sse2(bf, f, e);
+      __m128i e2 = select_sse2(dh, d, e), e3 = select_sse2(hf, f, e);
+      _mm_storeu_si128((__m128i *)(out0 + x * 2), _mm_unpacklo_epi32(e0, e1));
+      _mm_storeu_si128((__m128i *)(out0 + x * 2 + 4),
+                       _mm_unpackhi_epi32(e0, e1));
+      _mm_storeu_si128((__m128i *)(out1 + x * 2), _mm_unpacklo_epi32(e2, e3));
+      _mm_storeu_si128((__m128i *)(out1 + x * 2 + 4),
+                       _mm_unpackhi_epi32(e2, e3));
+    }
+    scale2x_row_scalar(above + x, row + x, below + x, width - x, out0 + x * 2,
+                       out1 + x * 2);
+  }
+
+  // Stores a0 b0 c0 a1 b1 c1 a2 b2 c2 a3 b3 c3
+  __attribute__((target("sse2"))) static void
+  store3_sse2(uint32_t *out, __m128i a, __m128i b, __m128i c) {
+    __m128 fa = _mm_castsi128_ps(a), fb = _mm_castsi128_ps(b);
+    __m128 fc = _mm_castsi128_ps(c);
+    const int EVEN = _MM_SHUFFLE(2, 0, 2, 0);
+    __m128 v0 = _mm_shuffle_ps(_mm_shuffle_ps(fa, fb, _MM_SHUFFLE(0, 0, 1, 0)),
+                               _mm_shuffle_ps(fc, fa, _MM_SHUFFLE(1, 1, 0, 0)),
+                               EVEN);
+    __m128 v1 = _mm_shuffle_ps(_mm_shuffle_ps(fb, fc, _MM_SHUFFLE(1, 1, 1, 1)),
+                               _mm_shuffle_ps(fa, fb, _MM_SHUFFLE(2, 2, 2, 2)),
+                               EVEN);
+    __m128 v2 = _mm_shuffle_ps(_mm_shuffle_ps(fc, fa, _MM_SHUFFLE(3, 3, 2, 2)),
+                               _mm_shuffle_ps(fb, fc, _MM_SHUFFLE(3, 3, 3, 3)),
+                               EVEN);
+    _mm_storeu_ps((float *)out, v0);
+    _mm_storeu_ps((float *)(out + 4), v1);
+    _mm_storeu_ps((float *)(out + 8), v2);
+  }
+
+  __attribute__((target("sse2"))) static void
+  scale3x_row_sse2(const uint32_t *above, const uint32_t *row,
+                   const uint32_t *below, int width, uint32_t *out0,
+                   uint32_t *out1, uint32_t *out2) {
+    int x = 0;
+    for (; x + 4 <= width; x += 4) {
+      __m128i a = _mm_loadu_si128((const __m128i *)(above + x - 1));
+      __m128i b = _mm_loadu_si128((const __m128i *)(above + x));
+      __m128i c = _mm_loadu_si128((const __m128i *)(above + x + 1));
+      __m128i d = _mm_loadu_si128((const __m128i *)(row + x - 1));
+      __m128i e = _mm_loadu_si128((const __m128i *)(row + x));
+      __m128i f = _mm_loadu_si128((const __m128i *)(row + x + 1));
+      __m128i g = _mm_loadu_si128((const __m128i *)(below + x - 1));
+      __m128i h = _mm_loadu_si128((const __m128i *)(below + x));
+      __m128i i = _mm_loadu_si128((const __m128i *)(below + x + 1));
+      const __m128i ones = _mm_set1_epi32(-1);
+      __m128i edge = _mm_andnot_si128(
+          _mm_or_si128(_mm_cmpeq_epi32(b, h), _mm_cmpeq_epi32(d, f)), ones);
+      __m128i db = _mm_and_si128(edge, _mm_cmpeq_epi32(d, b));
+      __m128i bf = _mm_and_si128(edge, _mm_cmpeq_epi32(b, f));
+      __m128i dh = _mm_and_si128(edge, _mm_cmpeq_epi32(d, h));
+      __m128i hf = _mm_and_si128(edge, _mm_cmpeq_epi32(h, f));
+      __m128i ea = _mm_cmpeq_epi32(e, a), ec = _mm_cmpeq_epi32(e, c);
+      __m128i eg = _mm_cmpeq_epi32(e, g), ei = _mm_cmpeq_epi32(e, i);
+      __m128i m1 = _mm_or_si128(_mm_andnot_si128(ec, db),
+                                _mm_andnot_si128(ea, bf));
+      __m128i m3 = _mm_or_si128(_mm_andnot_si128(eg, db),
+                                _mm_andnot_si128(ea, dh));
+      __m128i m5 = _mm_or_si128(_mm_andnot_si128(ei, bf),
+                                _mm_andnot_si128(ec, hf));
+      __m128i m7 = _mm_or_si128(_mm_andnot_si128(ei, dh),
+                                _mm_andnot_si128(eg, hf));
+      store3_sse2(out0 + x * 3, select_sse2(db, d, e), select_sse2(m1, b, e),
+                  select_sse2(bf, f, e));
+      store3_sse2(out1 + x * 3, select_sse2(m3, d, e), e,
+                  select_sse2(m5, f, e));
+      store3_sse2(out2 + x * 3, select_sse2(dh, d, e), select_sse2(m7, h, e),
+                  select_sse2(hf, f, e));
+    }
+    scale3x_row_scalar(above + x, row + x, below + x, width - x, out0 + x * 3,
+                       out1 + x * 3, out2 + x * 3);
+  }
+
+  __attribute__((target("sse2"))) static void
+  darken_row_sse2(const uint32_t *src, const uint32_t *mask, uint32_t *dst,
+                  int count) {
+    int x = 0;
+    const __m128i low = _mm_set1_epi32(0x003F3F3F);
+    for (; x + 4 <= count; x += 4) {
+      __m128i p = _mm_loadu_si128((const __m128i *)(src + x));
+      __m128i m = _mm_loadu_si128((const __m128i *)(mask + x));
+      __m128i quarter = _mm_and_si128(_mm_srli_epi32(p, 2), low);
+      __m128i dark = _mm_sub_epi32(p, _mm_and_si128(m, quarter));
+      _mm_storeu_si128((__m128i *)(dst + x), dark);
+    }
+    darken_row_scalar(src + x, mask + x, dst + x, count - x);
+  }
+
+  __attribute__((target("sse2"))) static void
+  ghost_row_sse2(const uint32_t *cur, uint32_t *history, uint32_t *dst,
+                 int count) {
+    int x = 0;
+    for (; x + 4 <= count; x += 4) {
+      __m128i c = _mm_loadu_si128((const __m128i *)(cur + x));
+      __m128i h = _mm_loadu_si128((const __m128i *)(history + x));
+      __m128i out = _mm_avg_epu8(c, _mm_avg_epu8(c, h));
+      _mm_storeu_si128((__m128i *)(history + x), out);
+      _mm_storeu_si128((__m128i *)(dst + x), out);
+    }
+    ghost_row_scalar(cur + x, history + x, dst + x, count - x);
+  }
+
+  // The two streaming filters again, eight pixels at a time
+  __attribute__((target("avx2"))) static void
+  darken_row_avx2(const uint32_t *src, const uint32_t *mask, uint32_t *dst,
+                  int count) {
+    int x = 0;
+    const __m256i low = _mm256_set1_epi32(0x003F3F3F);
+    for (; x + 8 <= count; x += 8) {
+      __m256i p = _mm256_loadu_si256((const __m256i *)(src + x));
+      __m256i m = _mm256_loadu_si256((const __m256i *)(mask + x));
+      __m256i quarter = _mm256_and_si256(_mm256_srli_epi32(p, 2), low);
+      __m256i dark = _mm256_sub_epi32(p, _mm256_and_si256(m, quarter));
+      _mm256_storeu_si256((__m256i *)(dst + x), dark);
+    }
+    darken_row_scalar(src + x, mask + x, dst + x, count - x);
+  }
+
+  __attribute__((target("avx2"))) static void
+  ghost_row_avx2(const uint32_t *cur, uint32_t *history, uint32_t *dst,
+                 int count) {
+    int x = 0;
+    for (; x + 8 <= count; x += 8) {
+      __m256i c = _mm256_loadu_si256((const __m256i *)(cur + x));
+      __m256i h = _mm256_loadu_si256((const __m256i *)(history + x));
+      __m256i out = _mm256_avg_epu8(c, _mm256_avg_epu8(c, h));
+      _mm256_storeu_si256((__m256i *)(history + x), out);
+      _mm256_storeu_si256((__m256i *)(dst + x), out);
+    }
+    ghost_row_scalar(cur + x, history + x, dst + x, count - x);
+  }
+#endif
+
+private:
+  static UpscaleKernels detect() {
+    UpscaleKernels k = scalar();
+#ifdef VIDEO_X86_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+      k.scale_row = scale_row_sse2;
+      k.scale2x_row = scale2x_row_sse2;
+      k.scale3x_row = scale3x_row_sse2;
+      k.darken_row = darken_row_sse2;
+      k.ghost_row = ghost_row_sse2;
+      k.name = "sse2";
+    }
+    if (__builtin_cpu_supports("avx2")) {
+      k.darken_row = darken_row_avx2;
+      k.ghost_row = ghost_row_avx2;
+      k.name = "avx2";
+    }
+#endif
+    return k;
+  }
+};
+
+// =============================================================
+// Upscaler: the configured chain, with every buffer allocated by
+// configure() so run() never allocates
+// =============================================================
+class Upscaler {
+public:
+  enum StageType { Ghost, Integer, Scale2x, Scale3x, Grid };
+  struct Stage {
+    StageType type;
+    int factor; // Scale of this stage, 1 for filters
+  };
+
+  static constexpr int MAX_SCALE = 12; // Of the whole chain
+
+  std::vector<Stage> stages;
+  const UpscaleKernels *kernels = &UpscaleKernels::get();
+  std::string error; // Why configure() failed
+  int out_width = 0;
+  int out_height = 0;
+
+  // Parses a chain such as "scale2x,int2,grid" for frames of the given
+  // size. An empty spec passes frames through as they are.
+  bool configure(const std::string &spec, int width, int height) {
+    stages.clear();
+    error.clear();
+    in_width = width;
+    in_height = height;
+    int scale = 1;
+    std::size_t start = 0;
+    while (start < spec.size()) {
+      std::size_t end = spec.find(',', start);
+      if (end == std::string::npos)
+        end = spec.size();
+      std::string name = spec.substr(start, end - start);
+      start = end + 1;
+
+      Stage stage;
+      if (name == "ghost")
+        stage = {Ghost, 1};
+      else if (name == "grid" && scale >= 3)
+        stage = {Grid, 1};
+      else if (name == "grid") { // No room for a line between pixels
+        error = "grid needs a scale of 3 or more before it";
+        return false;
+      }
+      else if (name == "scale2x")
+        stage = {Scale2x, 2};
+      else if (name == "scale3x")
+        stage = {Scale3x, 3};
+      else if (name.size() == 4 && name.compare(0, 3, "int") == 0 &&
+               name[3] >= '2' && name[3] <= '6')
+        stage = {Integer, name[3] - '0'};
+      else {
+        error = "Unknown stage: " + name;
+        return false;
+      }
+      scale *= stage.factor;
+      if (scale > MAX_SCALE) {
+        error = "Chain scales by more than " + std::to_string(MAX_SCALE);
+        return false;
+      }
+      stages.push_back(stage);
+    }
+    out_width = width * scale;
+    out_height = height * scale;
+
+    std::size_t largest = std::size_t(out_width) * out_height;
+    for (std::vector<uint32_t> &buffer : buffers)
+      buffer.assign(largest, 0);
+    padded.assign(std::size_t(out_width + 2) * (out_height + 2), 0);
+    grid_mask.assign(std::size_t(out_width) * 2, 0xFFFFFFFF);
+    history.assign(largest, 0);
+    have_history = false;
+    return true;
+  }
+
+  // Runs the chain on a frame of the configured size. The result, of
+  // out_width x out_height, stays valid until the next call.
+  const uint32_t *run(const uint32_t *frame) {
+    const uint32_t *in = frame;
+    int w = in_width, h = in_height, scale = 1;
+    for (const Stage &stage : stages) {
+      uint32_t *out = in == buffers[0].data() ? buffers[1].data()
+                                               : buffers[0].data();
+      switch (stage.type) {
+      case Ghost:
+        if (!have_history) // First frame, nothing to mix with yet
+          std::copy(in, in + std::size_t(w) * h, history.begin());
+        have_history = true;
+        for (int y = 0; y < h; y++)
+          kernels->ghost_row(&in[y * w], &history[y * w], &out[y * w], w);
+        break;
+      case Integer:
+        for (int y = 0; y < h; y++) {
+          uint32_t *first = &out[y * stage.factor * w * stage.factor];
+          kernels->scale_row(&in[y * w], w, stage.factor, first);
+          for (int i = 1; i < stage.factor; i++)
+            std::memcpy(first + i * w * stage.factor, first,
+                        w * stage.factor * sizeof(uint32_t));
+        }
+        break;
+      case Scale2x:
+      case Scale3x: {
+        const uint32_t *p = pad(in, w, h);
+        int pw = w + 2, ow = w * stage.factor;
+        for (int y = 0; y < h; y++) {
+          const uint32_t *row = &p[(y + 1) * pw + 1];
+          uint32_t *o = &out[y * stage.factor * ow];
+          if (stage.type == Scale2x)
+            kernels->scale2x_row(row - pw, row, row + pw, w, o, o + ow);
+          else
+            kernels->scale3x_row(row - pw, row, row + pw, w, o, o + ow,
+                                 o + ow * 2);
+        }
+        break;
+      }
+      case Grid:
+        for (int x = 0; x < w; x++)
+          grid_mask[x] = x % scale == scale - 1 ? 0xFFFFFFFF : 0;
+        for (int y = 0; y < h; y++) {
+          if (y % scale == scale - 1) // Whole row is the line
+            kernels->darken_row(&in[y * w], &grid_mask[out_width],
+                                &out[y * w], w);
+          else
+            kernels->darken_row(&in[y * w], grid_mask.data(), &out[y * w],
+                                w);
+        }
+        break;
+      }
+      w *= stage.factor;
+      h *= stage.factor;
+      scale *= stage.factor;
+      in = out;
+    }
+    return in;
+  }
+
+private:
+  int in_width = 0;
+  int in_height = 0;
+  std::vector<uint32_t> buffers[2]; // Stages alternate between these
+  std::vector<uint32_t> padded;     // Input with its edges repeated
+  std::vector<uint32_t> grid_mask;  // And a row of all ones after it
+  std::vector<uint32_t> history;    // Last ghosted frame
+  bool have_history = false;
+
+  // Copies the image with a one pixel border repeating its edges, so
+  // the Scale2x/3x kernels can read past them
+  const uint32_t *pad(const uint32_t *in, int w, int h) {
+    int pw = w + 2;
+    for (int y = 0; y < h + 2; y++) {
+      int sy = y == 0 ? 0 : (y > h ? h - 1 : y - 1);
+      uint32_t *row = &padded[y * pw];
+      std::memcpy(row + 1, &in[sy * w], w * sizeof(uint32_t));
+      row[0] = row[1];
+      row[w + 1] = row[w];
+    }
+    return padded.data();
+  }
+};
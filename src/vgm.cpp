@@ -0,0 +1,296 @@
+// VGM (Video Game Music) log playback for the Game Boy DMG chip.
+// https://vgmrips.net/wiki/VGM_Specification
+// The file is memory mapped and parsed in place. DMG register writes
+// (command 0xB3) come out stamped with the cycle they belong to, ready to
+// post to APU::write_queue; wait commands only move the clock on.
+#pragma once
+
+#include "audio.cpp"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define VGM_HAS_MMAP 1
+#else
+#include <cstdio>
+#include <vector>
+#endif
+
+// =============================================================
+// MappedFile: read-only view of a whole file
+// =============================================================
+class MappedFile {
+public:
+  MappedFile() {
+    bytes = nullptr;
+    length = 0;
+  }
+  ~MappedFile() { close(); }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  bool open(const char *path) {
+    close();
+#ifdef VGM_HAS_MMAP
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+      return false;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+      ::close(fd);
+      return false;
+    }
+    void *map = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd); // The mapping keeps the file alive
+    if (map == MAP_FAILED)
+      return false;
+    madvise(map, info.st_size, MADV_SEQUENTIAL);
+    bytes = static_cast<const uint8_t *>(map);
+    length = info.st_size;
+#else
+    std::FILE *file = std::fopen(path, "rb");
+    if (!file)
+      return false;
+    std::fseek(file, 0, SEEK_END);
+    long size = std::ftell(file);
+    std::fseek(file, 0, SEEK_SET);
+    if (size <= 0) {
+      std::fclose(file);
+      return false;
+    }
+    copy.resize(size);
+    length = std::fread(copy.data(), 1, size, file);
+    std::fclose(file);
+    bytes = copy.data();
+#endif
+    return true;
+  }
+
+  void close() {
+#ifdef VGM_HAS_MMAP
+    if (bytes)
+      munmap(const_cast<uint8_t *>(bytes), length);
+#else
+    copy.clear();
+#endif
+    bytes = nullptr;
+    length = 0;
+  }
+
+  const uint8_t *data() const { return bytes; }
+  std::size_t size() const { return length; }
+
+private:
+  const uint8_t *bytes;
+  std::size_t length;
+#ifndef VGM_HAS_MMAP
+  std::vector<uint8_t> copy;
+#endif
+};
+
+// =============================================================
+// VgmPlayer: walks the command stream of one file
+// =============================================================
+class VgmPlayer {
+public:
+  static constexpr int VGM_RATE = 44100; // Wait commands count these
+
+  uint32_t version = 0;
+  uint32_t total_samples = 0; // Length of one pass, in VGM_RATE samples
+  uint32_t loop_samples = 0;
+  uint32_t dmg_clock = 0;
+  const char *error = nullptr; // Set when load() fails
+
+  // `data` must stay valid while playing (e.g. a MappedFile)
+  bool load(const uint8_t *data, std::size_t size) {
+    file = data;
+    file_size = size;
+    if (size >= 2 && data[0] == 0x1F && data[1] == 0x8B)
+      return fail("compressed .vgz, gunzip it first");
+    if (size < 0x40 || std::memcmp(data, "Vgm ", 4) != 0)
+      return fail("not a VGM file");
+
+    version = read_u32(0x08);
+    total_samples = read_u32(0x18);
+    loop_samples = read_u32(0x20);
+
+    // Offsets in the header are relative to their own position
+    uint32_t data_offset = 0x40;
+    if (version >= 0x150 && read_u32(0x34) != 0)
+      data_offset = 0x34 + read_u32(0x34);
+    uint32_t loop_offset = read_u32(0x1C);
+    loop_pos = loop_offset ? 0x1C + loop_offset : 0;
+    uint32_t eof_offset = read_u32(0x04);
+    end_pos = eof_offset ? 0x04 + eof_offset : size;
+    if (end_pos > size)
+      end_pos = size;
+
+    // The DMG clock field only exists when the header reaches it
+    dmg_clock = (version >= 0x161 && data_offset >= 0x84) ? read_u32(0x80)
+                                                          : 0;
+    if ((dmg_clock & 0x3FFFFFFF) == 0)
+      return fail("no Game Boy DMG chip in this file");
+    if (data_offset >= end_pos || loop_pos >= end_pos)
+      return fail("bad data or loop offset");
+
+    start_pos = data_offset;
+    restart(0);
+    return true;
+  }
+
+  // Plays the looped section `loops` more times after the first pass
+  void restart(int loops) {
+    pos = start_pos;
+    loops_left = loops;
+    samples = 0;
+    finished = false;
+  }
+
+  bool done() const { return finished; }
+
+  // VGM samples elapsed so far, converted to APU cycles
+  uint64_t cycle() const {
+    return samples * uint64_t(APU::CLOCK_RATE) / VGM_RATE;
+  }
+
+  // Produces the next DMG register write. Returns false at the end.
+  bool next(APU::RegisterWrite &out) {
+    while (!finished) {
+      if (pos >= end_pos) {
+        end_of_data();
+        continue;
+      }
+      uint8_t cmd = file[pos];
+
+      if (cmd == 0xB3) {
+        if (!need(3))
+          continue;
+        uint8_t reg = file[pos + 1];
+        uint8_t value = file[pos + 2];
+        pos += 3;
+        if (reg & 0x80)
+          continue; // Second DMG chip, not emulated
+        out = {cycle(), uint16_t(0xFF10 + reg), value};
+        return true;
+      }
+
+      switch (cmd) {
+      case 0x61:
+        if (!need(3))
+          break;
+        samples += file[pos + 1] | (file[pos + 2] << 8);
+        pos += 3;
+        break;
+      case 0x62:
+        samples += 735; // One 60Hz frame
+        pos += 1;
+        break;
+      case 0x63:
+        samples += 882; // One 50Hz frame
+        pos += 1;
+        break;
+      case 0x66:
+        end_of_data();
+        break;
+      case 0x67: // Data block: 0x67 0x66 tt ssssssss
+        if (!need(7))
+          break;
+        pos += 7 + std::size_t(read_u32(pos + 3));
+        break;
+      default:
+        if (cmd >= 0x70 && cmd <= 0x7F) {
+          samples += (cmd & 0x0F) + 1;
+          pos += 1;
+        } else if (int length = command_length(cmd)) {
+          if (cmd >= 0x80 && cmd <= 0x8F)
+            samples += cmd & 0x0F; // YM2612 sample write and wait
+          pos += length;
+        } else {
+          finished = true; // Unknown command, stop rather than guess
+        }
+        break;
+      }
+    }
+    return false;
+  }
+
+private:
+  const uint8_t *file = nullptr;
+  std::size_t file_size = 0;
+  std::size_t start_pos = 0;
+  std::size_t loop_pos = 0;
+  std::size_t end_pos = 0;
+  std::size_t pos = 0;
+  uint64_t samples = 0;
+  int loops_left = 0;
+  bool finished = true;
+
+  bool fail(const char *message) {
+    error = message;
+    finished = true;
+    return false;
+  }
+
+  uint32_t read_u32(std::size_t at) const {
+    if (at + 4 > file_size)
+      return 0;
+    return file[at] | (file[at + 1] << 8) | (file[at + 2] << 16) |
+           (uint32_t(file[at + 3]) << 24);
+  }
+
+  // True if the command at pos has `length` bytes before the end
+  bool need(std::size_t length) {
+    if (pos + length <= end_pos)
+      return true;
+    pos = end_pos;
+    return false;
+  }
+
+  void end_of_data() {
+    if (loops_left > 0 && loop_pos != 0) {
+      loops_left--;
+      pos = loop_pos;
+    } else {
+      finished = true;
+    }
+  }
+
+  // Total size of the commands this player skips, 0 if unknown
+  static int command_length(uint8_t cmd) {
+    if (cmd >= 0x30 && cmd <= 0x3F)
+      return 2;
+    if (cmd == 0x4F || cmd == 0x50)
+      return 2;
+    if (cmd >= 0x40 && cmd <= 0x5F)
+      return 3;
+    if (cmd == 0x68)
+      return 12;
+    if (cmd >= 0x80 && cmd <= 0x8F)
+      return 1;
+    switch (cmd) {
+    case 0x90:
+    case 0x91:
+    case 0x95:
+      return 5;
+    case 0x92:
+      return 6;
+    case 0x93:
+      return 11;
+    case 0x94:
+      return 2;
+    }
+    if (cmd >= 0xA0 && cmd <= 0xBF)
+      return 3;
+    if (cmd >= 0xC0 && cmd <= 0xDF)
+      return 4;
+    if (cmd >= 0xE0)
+      return 5;
+    return 0;
+  }
+};
@@ -0,0 +1,225 @@
+// Renders Game Boy VGM logs through the APU to WAV files, one worker
+// thread per core. Meant for load testing and profiling the audio core on
+// real game music rather than the single built-in melody.
+//
+// Usage: VgmRender [options] FILE.vgm...
+//   -o DIR       Directory for the .wav files (default: next to the input)
+//   --jobs N     Worker threads (default: one per core)
+//   --loops N    Extra passes through the looped section (default 0)
+//   --rate HZ    Output sample rate (default 48000)
+//   --float      Write 32-bit float samples instead of 16-bit PCM
+//   --point      Point sample the channels instead of BLEP synthesis
+//   --null       Render without writing any files
+
+#include "audio.cpp"
+#include "resampler.cpp"
+#include "vgm.cpp"
+#include "wav.cpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+const int APU_RATE = APU::CLOCK_RATE / 64; // Whole cycles per sample
+
+struct Options {
+  std::string out_dir;
+  int loops = 0;
+  int rate = 48000;
+  bool use_float = false;
+  bool use_blep = true;
+  bool write_files = true;
+};
+
+struct Result {
+  bool ok = false;
+  const char *error = nullptr;
+  std::size_t frames = 0;
+  double seconds = 0.0; // Time spent rendering, without file output
+};
+
+std::string wav_path(const std::string &input, const Options &options) {
+  std::string name = input;
+  std::size_t dot = name.rfind('.');
+  std::size_t slash = name.find_last_of("/\\");
+  if (dot != std::string::npos && (slash == std::string::npos || dot > slash))
+    name.erase(dot);
+  if (!options.out_dir.empty()) {
+    if (slash != std::string::npos)
+      name.erase(0, slash + 1);
+    name = options.out_dir + "/" + name;
+  }
+  return name + ".wav";
+}
+
+Result render_file(const std::string &path, const Options &options) {
+  Result result;
+  MappedFile file;
+  if (!file.open(path.c_str())) {
+    result.error = "can't open file";
+    return result;
+  }
+  VgmPlayer player;
+  if (!player.load(file.data(), file.size())) {
+    result.error = player.error;
+    return result;
+  }
+  player.restart(options.loops);
+
+  WavWriter wav;
+  if (options.write_files &&
+      !wav.open(wav_path(path, options).c_str(), options.rate, 2,
+                options.use_float ? WavWriter::Float32 : WavWriter::PCM16)) {
+    result.error = "can't write output";
+    return result;
+  }
+
+  // The APU and resampler are large, keep them off the thread's stack
+  std::unique_ptr<APU> apu(new APU());
+  std::unique_ptr<Resampler> resampler(new Resampler());
+  apu->write_byte(0xFF26, 0x80); // Logs assume the APU is powered on
+  apu->set_sample_rate(APU_RATE);
+  if (options.use_blep)
+    apu->enable_blep(APU_RATE);
+  resampler->set_rates(APU_RATE, options.rate);
+
+  const std::size_t BLOCK = 4096;
+  std::vector<float> buffer(BLOCK * 2);
+  APU::RegisterWrite pending;
+  bool has_pending = player.next(pending);
+  uint64_t end_cycle = 0;
+  // Queue writes ahead of the render; the APU applies each one at its
+  // exact cycle and the queue holds the rest back
+  auto post_writes = [&] {
+    while (has_pending && apu->post_write(pending.cycle, pending.addr,
+                                          pending.value))
+      has_pending = player.next(pending);
+  };
+  // With a write that didn't fit, render only up to it, so it is posted
+  // before its cycle rather than applied late
+  auto source = [&](float *out, std::size_t n) {
+    while (n > 0) {
+      post_writes();
+      std::size_t count = n;
+      if (has_pending)
+        count = std::min(count, apu->samples_until(pending.cycle));
+      apu->render(out, count);
+      out += count * 2;
+      n -= count;
+    }
+  };
+
+  while (true) {
+    post_writes();
+    if (!has_pending)
+      end_cycle = player.cycle(); // Includes the trailing wait
+
+    std::size_t frames = BLOCK;
+    if (!has_pending) {
+      uint64_t rendered = result.frames * uint64_t(APU::CLOCK_RATE) /
+                          uint64_t(options.rate);
+      if (rendered >= end_cycle)
+        break;
+      uint64_t left = (end_cycle - rendered) * options.rate / APU::CLOCK_RATE;
+      if (left < frames)
+        frames = left ? left : 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    resampler->process(buffer.data(), frames, source);
+    result.seconds += std::chrono::duration<double>(
+                          std::chrono::steady_clock::now() - start)
+                          .count();
+    if (options.write_files)
+      wav.write(buffer.data(), frames);
+    result.frames += frames;
+  }
+
+  result.ok = true;
+  return result;
+}
+
+int main(int argc, char **argv) {
+  Options options;
+  unsigned jobs = std::thread::hardware_concurrency();
+  std::vector<std::string> inputs;
+
+  for (int i = 1; i < argc; i++) {
+    bool has_value = i + 1 < argc;
+    if (!std::strcmp(argv[i], "-o") && has_value)
+      options.out_dir = argv[++i];
+    else if (!std::strcmp(argv[i], "--jobs") && has_value)
+      jobs = std::atoi(argv[++i]);
+    else if (!std::strcmp(argv[i], "--loops") && has_value)
+      options.loops = std::atoi(argv[++i]);
+    else if (!std::strcmp(argv[i], "--rate") && has_value)
+      options.rate = std::atoi(argv[++i]);
+    else if (!std::strcmp(argv[i], "--float"))
+      options.use_float = true;
+    else if (!std::strcmp(argv[i], "--point"))
+      options.use_blep = false;
+    else if (!std::strcmp(argv[i], "--null"))
+      options.write_files = false;
+    else if (argv[i][0] == '-') {
+      std::fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      return 1;
+    } else
+      inputs.push_back(argv[i]);
+  }
+  if (inputs.empty()) {
+    std::fprintf(stderr, "Usage: VgmRender [options] FILE.vgm...\n");
+    return 1;
+  }
+  if (options.rate <= 0 || options.loops < 0) {
+    std::fprintf(stderr, "Invalid --rate or --loops\n");
+    return 1;
+  }
+  if (jobs == 0)
+    jobs = 1;
+  if (jobs > inputs.size())
+    jobs = inputs.size();
+
+  // Workers take the next file off a shared counter until none are left
+  std::vector<Result> results(inputs.size());
+  std::atomic<std::size_t> next_input{0};
+  auto worker = [&]() {
+    for (std::size_t i = next_input++; i < inputs.size(); i = next_input++)
+      results[i] = render_file(inputs[i], options);
+  };
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < jobs; i++)
+    threads.emplace_back(worker);
+  worker();
+  for (std::thread &thread : threads)
+    thread.join();
+  double wall = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+
+  std::size_t total_frames = 0;
+  int failed = 0;
+  for (std::size_t i = 0; i < inputs.size(); i++) {
+    const Result &r = results[i];
+    if (!r.ok) {
+      std::fprintf(stderr, "%s: %s\n", inputs[i].c_str(), r.error);
+      failed++;
+      continue;
+    }
+    total_frames += r.frames;
+    std::printf("%s: %.2f s of audio, %.0f samples/s\n", inputs[i].c_str(),
+                double(r.frames) / options.rate,
+                r.seconds > 0.0 ? r.frames / r.seconds : 0.0);
+  }
+  std::printf("%zu files on %u threads in %.3f s: %.0f samples/s total\n",
+              inputs.size() - failed, jobs, wall,
+              wall > 0.0 ? total_frames / wall : 0.0);
+  return failed ? 1 : 0;
+}
@@ -3,9 +3,19 @@
 // 32768 colors for GameBoy (CGB)
 // Video Ram is 16K bytes (2 Banks)
 // Tile Maps are fixed for 1024 bytes so we only specify the lower limit
+#pragma once
 
+#include <cstddef>
 #include <cstdint>
 #include <cstring>
+#include <vector>
+
+// x86 SIMD kernels are compiled per function with target attributes and
+// picked at startup from what the CPU supports
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VIDEO_X86_DISPATCH 1
+#include <immintrin.h>
+#endif
 
 // =============================================================
 // LCDC: LCD Control Register (FF40)
@@ -80,6 +90,325 @@ public:
   bool is_interrupt_enabled(Mask mask) const { return (data & mask) != 0; }
 };
 
+// =============================================================
+// TileRow: decodes one row of a tile (two bitplanes) into eight
+// 2-bit colour ids at once, one per byte, leftmost pixel in the
+// lowest byte (the first one in memory on little endian hosts).
+// =============================================================
+struct TileRow {
+  static uint64_t decode(uint8_t lo, uint8_t hi, bool h_flip) {
+    const uint64_t *spread = tables().spread[h_flip ? 1 : 0];
+    return spread[lo] | (spread[hi] << 1);
+  }
+
+private:
+  // spread[0][b] has bit 7-i of b in byte i, spread[1] is mirrored
+  struct Tables {
+    uint64_t spread[2][256];
+
+    Tables() {
+      for (int b = 0; b < 256; b++) {
+        spread[0][b] = spread[1][b] = 0;
+        for (int i = 0; i < 8; i++) {
+          if (b & (0x80 >> i))
+            spread[0][b] |= uint64_t(1) << (i * 8);
+          if (b & (0x01 << i))
+            spread[1][b] |= uint64_t(1) << (i * 8);
+        }
+      }
+    }
+  };
+
+  static const Tables &tables() {
+    static const Tables t;
+    return t;
+  }
+};
+
+// =============================================================
+// PixelKernels: the per-tile and per-line inner loops, with SIMD
+// versions chosen at runtime. get() returns the best set for the
+// CPU; the individual versions stay callable for tests and benches.
+// =============================================================
+struct PixelKernels {
+  // Decodes the 16 bytes of a tile into rows[0] (plain) and rows[1]
+  // (mirrored), eight rows of TileRow::decode() output each
+  void (*decode_tile)(const uint8_t *data, uint64_t (*rows)[8]);
+
+  // Composites `count` pixels of packed BG and OBJ line data (see
+  // LCD::render_scanline) into out[], through `palette`: 32 BG colours
+  // followed by 32 OBJ colours.
+  void (*compose)(const uint8_t *bg, const uint8_t *obj,
+                  const uint32_t *palette, bool bg_priority, uint32_t *out,
+                  int count);
+  const char *name;
+
+  static const PixelKernels &get() {
+    static const PixelKernels kernels = detect();
+    return kernels;
+  }
+
+  static void decode_tile_scalar(const uint8_t *data, uint64_t (*rows)[8]) {
+    for (int row = 0; row < 8; row++) {
+      rows[0][row] = TileRow::decode(data[row * 2], data[row * 2 + 1], false);
+      rows[1][row] = TileRow::decode(data[row * 2], data[row * 2 + 1], true);
+    }
+  }
+
+  static void compose_scalar(const uint8_t *bg, const uint8_t *obj,
+                             const uint32_t *palette, bool bg_priority,
+                             uint32_t *out, int count) {
+    for (int x = 0; x < count; x++) {
+      uint8_t b = bg[x];
+      uint8_t o = obj[x];
+      bool show_obj = o && (!bg_priority || (b & 0x03) == 0 ||
+                            !((b | o) & 0x80));
+      out[x] = show_obj ? palette[32 + (o & 0x1F)] : palette[b & 0x1F];
+    }
+  }
+
+#ifdef VIDEO_X86_DISPATCH
+  // pdep drops each bitplane straight into bit 0 or 1 of the eight
+  // bytes, in mirrored order; a byte swap gives the plain order
+  __attribute__((target("bmi2"))) static void
+  decode_tile_bmi2(const uint8_t *data, uint64_t (*rows)[8]) {
+    for (int row = 0; row < 8; row++) {
+      uint64_t mirrored = _pdep_u64(data[row * 2], 0x0101010101010101ull) |
+                          _pdep_u64(data[row * 2 + 1], 0x0202020202020202ull);
+      rows[1][row] = mirrored;
+      rows[0][row] = __builtin_bswap64(mirrored);
+    }
+  }
+
+  // Palette indices for 16 pixels: the OBJ colour (index | 32) where the
+  // sprite pixel wins, else the BG colour
+  __attribute__((target("sse2"))) static __m128i
+  compose_indices_sse2(__m128i b, __m128i o, bool bg_priority) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i obj_present = _mm_xor_si128(_mm_cmpeq_epi8(o, zero),
+                                        _mm_set1_epi8(-1));
+    __m128i show = obj_present;
+    if (bg_priority) {
+      __m128i bg_clear =
+          _mm_cmpeq_epi8(_mm_and_si128(b, _mm_set1_epi8(0x03)), zero);
+      __m128i no_priority = _mm_cmpeq_epi8(
+          _mm_and_si128(_mm_or_si128(b, o), _mm_set1_epi8(char(0x80))), zero);
+      show = _mm_and_si128(show, _mm_or_si128(bg_clear, no_priority));
+    }
+    __m128i bg_index = _mm_and_si128(b, _mm_set1_epi8(0x1F));
+    __m128i obj_index = _mm_or_si128(_mm_and_si128(o, _mm_set1_epi8(0x1F)),
+                                     _mm_set1_epi8(0x20));
+    return _mm_or_si128(_mm_and_si128(show, obj_index),
+                        _mm_andnot_si128(show, bg_index));
+  }
+
+  // Priority resolved 16 pixels at a time, palette reads stay scalar
+  __attribute__((target("sse2"))) static void
+  compose_sse2(const uint8_t *bg, const uint8_t *obj, const uint32_t *palette,
+               bool bg_priority, uint32_t *out, int count) {
+    int x = 0;
+    alignas(16) uint8_t index[16];
+    for (; x + 16 <= count; x += 16) {
+      __m128i b = _mm_loadu_si128((const __m128i *)(bg + x));
+      __m128i o = _mm_loadu_si128((const __m128i *)(obj + x));
+      __m128i indices = compose_indices_sse2(b, o, bg_priority);
+      _mm_store_si128((__m128i *)index, indices);
+      for (int i = 0; i < 16; i++)
+        out[x + i] = palette[index[i]];
+    }
+    compose_scalar(bg + x, obj + x, palette, bg_priority, out + x, count - x);
+  }
+
+  // As compose_sse2, with the palette reads done by gathers
+  __attribute__((target("avx2"))) static void
+  compose_avx2(const uint8_t *bg, const uint8_t *obj, const uint32_t *palette,
+               bool bg_priority, uint32_t *out, int count) {
+    int x = 0;
+    for (; x + 16 <= count; x += 16) {
+      __m128i b = _mm_loadu_si128((const __m128i *)(bg + x));
+      __m128i o = _mm_loadu_si128((const __m128i *)(obj + x));
+      __m128i index = compose_indices_sse2(b, o, bg_priority);
+      __m256i lo = _mm256_cvtepu8_epi32(index);
+      __m256i hi = _mm256_cvtepu8_epi32(_mm_srli_si128(index, 8));
+      _mm256_storeu_si256((__m256i *)(out + x),
+                          _mm256_i32gather_epi32((const int *)palette, lo, 4));
+      _mm256_storeu_si256((__m256i *)(out + x + 8),
+                          _mm256_i32gather_epi32((const int *)palette, hi, 4));
+    }
+    compose_scalar(bg + x, obj + x, palette, bg_priority, out + x, count - x);
+  }
+#endif
+
+private:
+  static PixelKernels detect() {
+    PixelKernels k = {decode_tile_scalar, compose_scalar, "scalar"};
+#ifdef VIDEO_X86_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+      k.compose = compose_sse2;
+      k.name = "sse2";
+    }
+    if (__builtin_cpu_supports("avx2")) {
+      k.compose = compose_avx2;
+      k.name = "avx2";
+    }
+    if (__builtin_cpu_supports("bmi2"))
+      k.decode_tile = decode_tile_bmi2;
+#endif
+    return k;
+  }
+};
+
+// =============================================================
+// TileCache: every tile in VRAM (384 per bank) decoded ahead of
+// time with TileRow, plain and mirrored. Writes only mark tiles
+// dirty; refresh() redecodes those before the next line is drawn,
+// so the renderer just copies rows.
+// =============================================================
+class TileCache {
+public:
+  static constexpr int TILES = 384; // 8000-97FF, 16 bytes each
+
+  TileCache() { invalidate_all(); }
+
+  // `offset` is relative to the start of the bank (0x8000)
+  void invalidate(int bank, uint16_t offset) {
+    if (offset >= TILES * 16)
+      return; // Tile maps, not tile data
+    int index = bank * TILES + offset / 16;
+    dirty[index / 64] |= uint64_t(1) << (index % 64);
+  }
+
+  void invalidate_range(int bank, uint16_t offset, std::size_t length) {
+    for (std::size_t i = 0; i < length; i += 16)
+      invalidate(bank, offset + i);
+    if (length > 0)
+      invalidate(bank, offset + length - 1);
+  }
+
+  void invalidate_all() {
+    for (uint64_t &word : dirty)
+      word = ~uint64_t(0);
+  }
+
+  void refresh(const uint8_t (*vram)[8192]) {
+    for (int w = 0; w < DIRTY_WORDS; w++) {
+      while (dirty[w]) {
+        int index = w * 64 + __builtin_ctzll(dirty[w]);
+        dirty[w] &= dirty[w] - 1;
+        int bank = index / TILES;
+        int tile = index % TILES;
+        PixelKernels::get().decode_tile(&vram[bank][tile * 16],
+                                        rows[bank][tile]);
+      }
+    }
+  }
+
+  // Eight colour ids, as TileRow::decode() returns them
+  uint64_t row(int bank, int tile, int row, bool h_flip) const {
+    return rows[bank][tile][h_flip ? 1 : 0][row];
+  }
+
+private:
+  static constexpr int DIRTY_WORDS = 2 * TILES / 64;
+  uint64_t rows[2][TILES][2][8];
+  uint64_t dirty[DIRTY_WORDS]; // One bit per bank and tile
+};
+
+// =============================================================
+// SpriteTable: OAM as structure of arrays, plus the sprites on
+// each line (at most 10, in OAM order, which is the CGB priority
+// order). Rebuilt only after OAM or the sprite height changes.
+// =============================================================
+class SpriteTable {
+public:
+  static constexpr int SPRITES = 40;
+  static constexpr int MAX_PER_LINE = 10;
+  static constexpr int LINES = 144;
+
+  uint8_t y[SPRITES];
+  uint8_t x[SPRITES];
+  uint8_t tile[SPRITES];
+  uint8_t flags[SPRITES];
+
+  uint8_t line_count[LINES];
+  uint8_t line_sprites[LINES][MAX_PER_LINE];
+
+  SpriteTable() { invalidate(); }
+
+  void invalidate() { height = 0; }
+
+  void refresh(const uint8_t *oam, int sprite_height) {
+    if (height == sprite_height)
+      return;
+    height = sprite_height;
+    for (int i = 0; i < SPRITES; i++) {
+      y[i] = oam[i * 4];
+      x[i] = oam[i * 4 + 1];
+      tile[i] = oam[i * 4 + 2];
+      flags[i] = oam[i * 4 + 3];
+    }
+
+    std::memset(line_count, 0, sizeof(line_count));
+    for (int i = 0; i < SPRITES; i++) {
+      int top = y[i] - 16;
+      for (int line = top < 0 ? 0 : top; line < top + height && line < LINES;
+           line++) {
+        if (line_count[line] < MAX_PER_LINE)
+          line_sprites[line][line_count[line]++] = i;
+      }
+    }
+  }
+
+private:
+  int height; // Sprite height the lines were built for, 0 when stale
+};
+
+// =============================================================
+// DmaBus: what the DMA engine needs from the memory map.
+// direct() returns the byte at addr when it and the rest of its
+// 256 byte page are plain memory (ROM, RAM banks) that can be
+// copied with memcpy, nullptr for I/O and anything else that has
+// to go through read() one byte at a time.
+// =============================================================
+struct DmaBus {
+  virtual const uint8_t *direct(uint16_t addr) = 0;
+  virtual uint8_t read(uint16_t addr) = 0;
+  virtual ~DmaBus() = default;
+};
+
+// =============================================================
+// FrameLog: everything render_scanline() reads, recorded by an LCD
+// with frame_log set instead of drawing, so the drawing can happen
+// on another thread (see video_pipeline.cpp). One entry per line
+// with the registers as the line starts, and the VRAM, OAM and
+// palette bytes written in between, in order.
+// =============================================================
+struct FrameLog {
+  enum Target : uint8_t { Vram0, Vram1, Oam, BgPalette, ObjPalette };
+
+  struct Write {
+    uint16_t offset;
+    uint8_t target;
+    uint8_t value;
+  };
+
+  struct Line {
+    uint32_t first_write; // Writes before this index come first
+    uint8_t ly, lcdc, scx, scy, wx, wy, window_line;
+    const uint32_t *color_lut; // As set on the LCD
+  };
+
+  std::vector<Line> lines;
+  std::vector<Write> writes;
+
+  // Keeps the capacity, so a reused log stops allocating
+  void clear() {
+    lines.clear();
+    writes.clear();
+  }
+};
+
 // =============================================================
 // LCD: Main PPU Class
 // =============================================================
@@ -101,16 +430,41 @@ public:
 
   uint8_t vbk = 0; // FF4F - VRAM Bank (0 or 1)
 
+  // Output, one RGBA pixel per uint32_t (R in the low byte)
+  static constexpr int SCREEN_WIDTH = 160;
+  static constexpr int SCREEN_HEIGHT = 144;
+  uint32_t framebuffer[SCREEN_WIDTH * SCREEN_HEIGHT];
+  uint32_t *output = framebuffer; // Where lines go, see frame_exchange.cpp
+  uint64_t line_hash[SCREEN_HEIGHT]; // Of each line as last drawn
+  bool line_dirty[SCREEN_HEIGHT];    // Changed since take_dirty_lines()
+  bool line_drawn[SCREEN_HEIGHT];    // Since blank_undrawn_lines()
+  uint8_t window_line = 0; // Window rows drawn so far this frame
+  TileCache tile_cache;     // Kept in step with vram by write_vram()
+  SpriteTable sprites;      // Kept in step with oam_ram by write_oam()
+  FrameLog *frame_log = nullptr; // Set to record lines instead of drawing
+
   // Memory
   uint8_t vram[2][8192];       // 16KB Video RAM (2 Banks)
   uint8_t oam_ram[160];        // OAM Memory (Sprites)
   uint8_t bg_palette_ram[64];  // CGB BG Palettes
   uint8_t obj_palette_ram[64]; // CGB OBJ Palettes
 
+  // The palettes as framebuffer pixels, index palette * 4 + colour.
+  // Updated by write_bgpd/obpd, call refresh_palettes() after writing
+  // the palette RAM directly.
+  uint32_t palette_rgba[2][32]; // [0] BG, [1] OBJ, as compose() wants
+  const uint32_t *color_lut = nullptr; // 15-bit colour to pixel, optional
+
   // DMA State
-  uint8_t dma_reg = 0; // FF46 (Legacy DMA)
+  DmaBus *dma_bus = nullptr; // Where DMA copies from, nothing without it
+  uint8_t dma_reg = 0;       // FF46 (Legacy DMA)
   bool dma_transferring = false;
-  int dma_timer = 0;
+  int dma_timer = 0;    // Cycles left of the OAM DMA
+  int stall_cycles = 0; // CPU halted by GDMA/HDMA, see take_stall_cycles()
+
+  // OAM DMA takes 160 M-cycles, a GDMA/HDMA block of 16 bytes 8
+  static constexpr int OAM_DMA_CYCLES = 640;
+  static constexpr int HDMA_BLOCK_CYCLES = 32;
 
   struct HDMA {
     uint16_t src_addr = 0;
@@ -152,7 +506,12 @@ public:
     std::memset(obj_palette_ram, 0x00, sizeof(obj_palette_ram));
     std::memset(vram, 0, sizeof(vram));
     std::memset(oam_ram, 0, sizeof(oam_ram));
+    std::memset(framebuffer, 0xFF, sizeof(framebuffer));
+    std::memset(line_hash, 0, sizeof(line_hash));
+    std::memset(line_dirty, 1, sizeof(line_dirty)); // Nothing shown yet
+    std::memset(line_drawn, 0, sizeof(line_drawn));
     vbk = 0;
+    refresh_palettes();
   }
 
   void reset_ly() {
@@ -163,6 +522,7 @@ public:
   void set_lyc(uint8_t value) {
     lyc = value;
     check_ly_coincidence();
+    update_stat_line();
   }
 
   void increment_ly() {
@@ -192,6 +552,8 @@ public:
     if (is_lcd_enabled() && stat.get_mode() == STAT::Transfer)
       return;
     vram[vbk][addr - 0x8000] = value;
+    tile_cache.invalidate(vbk, addr - 0x8000);
+    log_write(vbk ? FrameLog::Vram1 : FrameLog::Vram0, addr - 0x8000, value);
   }
 
   uint8_t read_vram(uint16_t addr) const {
@@ -201,16 +563,23 @@ public:
   }
 
   void write_oam(uint16_t addr, uint8_t value) {
+    if (dma_transferring)
+      return;
     if (is_lcd_enabled()) {
       if (stat.get_mode() == STAT::OAMSearch ||
           stat.get_mode() == STAT::Transfer)
         return;
     }
-    if ((addr - 0xFE00) < 160)
+    if ((addr - 0xFE00) < 160) {
       oam_ram[addr - 0xFE00] = value;
+      sprites.invalidate();
+      log_write(FrameLog::Oam, addr - 0xFE00, value);
+    }
   }
 
   uint8_t read_oam(uint16_t addr) const {
+    if (dma_transferring)
+      return 0xFF;
     if (is_lcd_enabled()) {
       if (stat.get_mode() == STAT::OAMSearch ||
           stat.get_mode() == STAT::Transfer)
@@ -225,6 +594,9 @@ public:
     if (stat.get_mode() == STAT::Transfer)
       return;
     bg_palette_ram[bgpi & 0x3F] = value;
+    palette_rgba[0][(bgpi & 0x3F) / 2] =
+        palette_pixel(bg_palette_ram, (bgpi & 0x3F) / 2);
+    log_write(FrameLog::BgPalette, bgpi & 0x3F, value);
     if (bgpi & 0x80)
       bgpi = (bgpi & 0x80) | ((bgpi + 1) & 0x3F);
   }
@@ -238,6 +610,9 @@ public:
     if (stat.get_mode() == STAT::Transfer)
       return;
     obj_palette_ram[obpi & 0x3F] = value;
+    palette_rgba[1][(obpi & 0x3F) / 2] =
+        palette_pixel(obj_palette_ram, (obpi & 0x3F) / 2);
+    log_write(FrameLog::ObjPalette, obpi & 0x3F, value);
     if (obpi & 0x80)
       obpi = (obpi & 0x80) | ((obpi + 1) & 0x3F);
   }
@@ -246,10 +621,16 @@ public:
                                                : obj_palette_ram[obpi & 0x3F];
   }
 
+  // The copy happens up front. The CPU keeps running, but OAM reads
+  // and writes are blocked until the transfer's time is up.
   void write_dma(uint8_t value) {
     dma_reg = value;
     dma_transferring = true;
-    dma_timer = 0;
+    dma_timer = OAM_DMA_CYCLES;
+    dma_copy(oam_ram, value << 8, sizeof(oam_ram));
+    sprites.invalidate();
+    for (int i = 0; i < 160; i++)
+      log_write(FrameLog::Oam, i, oam_ram[i]);
   }
 
   void write_hdma1(uint8_t value) {
@@ -276,13 +657,24 @@ public:
     hdma.reg_ff55 = value & 0x7F;
 
     if (hdma.general_mode) {
-      hdma.active = false; // GDMA finishes instantly in emulator tick
+      // GDMA copies everything now, with the CPU halted meanwhile
+      while (hdma.length > 0)
+        hdma_block();
       hdma.reg_ff55 = 0xFF;
     } else {
       hdma.active = true; // HDMA waits for H-Blank
+      if (!is_lcd_enabled())
+        hdma_block(); // No H-Blank is coming, one block goes now
     }
   }
 
+  // Cycles the CPU has to sit out for GDMA/HDMA since the last call
+  int take_stall_cycles() {
+    int cycles = stall_cycles;
+    stall_cycles = 0;
+    return cycles;
+  }
+
   uint8_t read_hdma5() const {
     return hdma.active ? ((hdma.length - 1) & 0x7F) : 0xFF;
   }
@@ -318,7 +710,452 @@ public:
     return get_color_from_ram(obj_palette_ram, palette_num, color_num);
   }
 
+  // =============================================================
+  // Mode timing
+  // Lines are OAM scan (mode 2), transfer (3) and H-Blank (0), then
+  // ten lines of V-Blank (1). Instead of stepping every dot, tick()
+  // jumps from one mode change to the next, so a caller can also run
+  // the CPU for next_event() cycles and only then call tick().
+  // =============================================================
+  static constexpr int CYCLES_PER_LINE = 456;
+  static constexpr int LINES_PER_FRAME = 154;
+  static constexpr int CYCLES_PER_FRAME = CYCLES_PER_LINE * LINES_PER_FRAME;
+  static constexpr int OAM_SCAN_CYCLES = 80;
+
+  enum Interrupt : uint8_t { // Bits of IF (FF0F)
+    VBlankInterrupt = 1 << 0,
+    StatInterrupt = 1 << 1
+  };
+  uint8_t interrupts = 0;    // Raised since the last take_interrupts()
+  int mode_cycles = 0;       // Until the next mode change
+  int transfer_cycles = 0;   // Length of mode 3 on this line
+  uint64_t frame_count = 0;  // V-Blanks so far
+  bool stat_line = false;    // STAT interrupt sources ORed together
+
+  void tick(int cycles) {
+    if (dma_transferring) {
+      dma_timer -= cycles;
+      if (dma_timer <= 0)
+        dma_transferring = false;
+    }
+    if (!is_lcd_enabled())
+      return;
+    while (cycles >= mode_cycles) {
+      cycles -= mode_cycles;
+      next_mode();
+    }
+    mode_cycles -= cycles;
+  }
+
+  // Cycles until tick() has something to do, -1 while the LCD is off
+  int next_event() const { return is_lcd_enabled() ? mode_cycles : -1; }
+
+  uint8_t take_interrupts() {
+    uint8_t raised = interrupts;
+    interrupts = 0;
+    return raised;
+  }
+
+  void write_lcdc(uint8_t value) {
+    bool was_on = is_lcd_enabled();
+    lcdc.data = value;
+    if (was_on && !is_lcd_enabled()) {
+      ly = 0;
+      window_line = 0;
+      stat.set_mode(STAT::HBlank);
+      check_ly_coincidence();
+      stat_line = false;
+    } else if (!was_on && is_lcd_enabled()) {
+      ly = 0;
+      window_line = 0;
+      stat.set_mode(STAT::OAMSearch);
+      mode_cycles = OAM_SCAN_CYCLES;
+      check_ly_coincidence();
+      update_stat_line();
+    }
+  }
+
+  // Bits 0-2 (mode, LY=LYC) are read only
+  void write_stat(uint8_t value) {
+    stat.data = (stat.data & 0x07) | (value & 0x78);
+    update_stat_line();
+  }
+
+  // =============================================================
+  // Scanline renderer
+  // Draws line `ly` into the output. Background and window are
+  // fetched a whole tile row at a time into a line of packed pixels
+  // (bits 0-1 colour id, 2-4 palette, 7 BG priority), sprites into a
+  // second line, and the two are composited through RGBA palettes.
+  // =============================================================
+  void render_scanline() {
+    if (ly < SCREEN_HEIGHT)
+      render_scanline(&output[ly * SCREEN_WIDTH]);
+  }
+
+  // Same, into any line of SCREEN_WIDTH pixels
+  void render_scanline(uint32_t *out) {
+    if (ly >= SCREEN_HEIGHT)
+      return;
+    if (ly == 0)
+      window_line = 0;
+    if (!is_lcd_enabled()) {
+      std::memset(out, 0xFF, SCREEN_WIDTH * sizeof(uint32_t));
+      mark_line(ly, out);
+      return;
+    }
+    tile_cache.refresh(vram);
+
+    // Room for a partly hidden tile on each side, and for the window
+    // starting up to 7 pixels left of the screen
+    alignas(8) uint8_t bg_line[8 + SCREEN_WIDTH + 24];
+    alignas(8) uint8_t obj_line[SCREEN_WIDTH];
+    uint8_t *bg = render_bg_line(bg_line);
+    render_window_line(bg);
+    render_sprite_line(obj_line);
+
+    // With LCDC bit 0 clear, sprites always go on top (CGB)
+    PixelKernels::get().compose(bg, obj_line, &palette_rgba[0][0],
+                                lcdc.is_bit_set(LCDC::BGDisplay), out,
+                                SCREEN_WIDTH);
+    mark_line(ly, out);
+  }
+
+  // Fills the lines of the output not drawn since the last call with
+  // white, as the screen shows them with the LCD off, so a frame cut
+  // short (LCD switched off, or never on) holds no stale pixels
+  void blank_undrawn_lines() {
+    for (int y = 0; y < SCREEN_HEIGHT; y++) {
+      if (!line_drawn[y]) {
+        uint32_t *out = &output[y * SCREEN_WIDTH];
+        std::memset(out, 0xFF, SCREEN_WIDTH * sizeof(uint32_t));
+        mark_line(y, out);
+      }
+      line_drawn[y] = false;
+    }
+  }
+
+  // Copies out which lines came out different since the last call and
+  // clears them, so a frontend only has to upload those. Returns how
+  // many there were; with none, the frame doesn't need presenting.
+  int take_dirty_lines(bool *dirty) {
+    int count = 0;
+    for (int y = 0; y < SCREEN_HEIGHT; y++) {
+      dirty[y] = line_dirty[y];
+      count += line_dirty[y];
+      line_dirty[y] = false;
+    }
+    return count;
+  }
+
+  // Passing nullptr goes back to the plain 5 to 8-bit expansion
+  void set_color_lut(const uint32_t *lut) {
+    color_lut = lut;
+    refresh_palettes();
+  }
+
+  void refresh_palettes() {
+    for (int i = 0; i < 32; i++) {
+      palette_rgba[0][i] = palette_pixel(bg_palette_ram, i);
+      palette_rgba[1][i] = palette_pixel(obj_palette_ram, i);
+    }
+  }
+
+  // Stores a FrameLog write straight into memory, no mode checks, and
+  // keeps the caches in step. For replaying a log.
+  void poke(FrameLog::Target target, uint16_t offset, uint8_t value) {
+    switch (target) {
+    case FrameLog::Vram0:
+    case FrameLog::Vram1:
+      vram[target - FrameLog::Vram0][offset] = value;
+      tile_cache.invalidate(target - FrameLog::Vram0, offset);
+      break;
+    case FrameLog::Oam:
+      oam_ram[offset] = value;
+      sprites.invalidate();
+      break;
+    case FrameLog::BgPalette:
+      bg_palette_ram[offset] = value;
+      palette_rgba[0][offset / 2] = palette_pixel(bg_palette_ram, offset / 2);
+      break;
+    case FrameLog::ObjPalette:
+      obj_palette_ram[offset] = value;
+      palette_rgba[1][offset / 2] = palette_pixel(obj_palette_ram, offset / 2);
+      break;
+    }
+  }
+
+  // Colour correction for the GBC screen, which mixes the channels and
+  // washes colours out compared to a PC monitor. Uses the channel mix
+  // popularised by higan/bsnes; set it with set_color_lut().
+  static const uint32_t *gbc_color_lut() {
+    struct Table {
+      uint32_t pixels[32768];
+
+      Table() {
+        for (int c = 0; c < 32768; c++) {
+          int r = c & 0x1F;
+          int g = (c >> 5) & 0x1F;
+          int b = (c >> 10) & 0x1F;
+          int out_r = r * 26 + g * 4 + b * 2;
+          int out_g = g * 24 + b * 8;
+          int out_b = r * 6 + g * 4 + b * 22;
+          pixels[c] = to_rgba({scale(out_r), scale(out_g), scale(out_b)});
+        }
+      }
+
+      static uint8_t scale(int v) { return (v > 960 ? 960 : v) * 255 / 960; }
+    };
+    static const Table table;
+    return table.pixels;
+  }
+
 private:
+  void next_mode() {
+    switch (stat.get_mode()) {
+    case STAT::OAMSearch:
+      stat.set_mode(STAT::Transfer);
+      transfer_cycles = get_transfer_cycles();
+      mode_cycles = transfer_cycles;
+      if (frame_log) // Registers as they are when the line starts
+        record_line();
+      else
+        render_scanline();
+      break;
+    case STAT::Transfer:
+      stat.set_mode(STAT::HBlank);
+      mode_cycles = CYCLES_PER_LINE - OAM_SCAN_CYCLES - transfer_cycles;
+      if (hdma.active)
+        hdma_block();
+      break;
+    case STAT::HBlank:
+      increment_ly();
+      if (ly == SCREEN_HEIGHT) {
+        stat.set_mode(STAT::VBlank);
+        mode_cycles = CYCLES_PER_LINE;
+        interrupts |= VBlankInterrupt;
+        frame_count++;
+      } else {
+        stat.set_mode(STAT::OAMSearch);
+        mode_cycles = OAM_SCAN_CYCLES;
+      }
+      break;
+    case STAT::VBlank:
+      increment_ly();
+      if (ly == 0) {
+        stat.set_mode(STAT::OAMSearch);
+        mode_cycles = OAM_SCAN_CYCLES;
+      } else {
+        mode_cycles = CYCLES_PER_LINE;
+      }
+      break;
+    }
+    update_stat_line();
+  }
+
+  void log_write(FrameLog::Target target, uint16_t offset, uint8_t value) {
+    if (frame_log)
+      frame_log->writes.push_back({offset, target, value});
+  }
+
+  // What render_scanline() would read, plus the window row it would
+  // have drawn
+  void record_line() {
+    if (ly >= SCREEN_HEIGHT)
+      return;
+    if (ly == 0)
+      window_line = 0;
+    frame_log->lines.push_back({uint32_t(frame_log->writes.size()), ly,
+                                lcdc.data, scx, scy, wx, wy, window_line,
+                                color_lut});
+    if (window_on_line())
+      window_line++;
+  }
+
+  // =============================================================
+  // DMA copies
+  // Runs of a source page that are plain memory are copied in one
+  // go, the rest byte by byte through the bus.
+  // =============================================================
+  void dma_copy(uint8_t *dest, uint16_t src, int length) {
+    if (!dma_bus)
+      return;
+    while (length > 0) {
+      int run = 0x100 - (src & 0xFF);
+      if (run > length)
+        run = length;
+      if (const uint8_t *page = dma_bus->direct(src))
+        std::memcpy(dest, page, run);
+      else
+        for (int i = 0; i < run; i++)
+          dest[i] = dma_bus->read(uint16_t(src + i));
+      dest += run;
+      src += run;
+      length -= run;
+    }
+  }
+
+  // One 16 byte GDMA/HDMA block into the current VRAM bank
+  void hdma_block() {
+    uint16_t dest = hdma.dest_addr & 0x1FF0;
+    dma_copy(&vram[vbk][dest], hdma.src_addr, 16);
+    tile_cache.invalidate_range(vbk, dest, 16);
+    for (int i = 0; i < 16; i++)
+      log_write(vbk ? FrameLog::Vram1 : FrameLog::Vram0, dest + i,
+                vram[vbk][dest + i]);
+    hdma.src_addr += 16;
+    hdma.dest_addr = (dest + 16) & 0x1FF0;
+    stall_cycles += HDMA_BLOCK_CYCLES;
+    if (--hdma.length == 0) {
+      hdma.active = false;
+      hdma.reg_ff55 = 0xFF;
+    }
+  }
+
+  // The interrupt fires when the OR of the enabled sources goes from
+  // low to high, so a source that stays high blocks the others
+  void update_stat_line() {
+    STAT::Mode mode = stat.get_mode();
+    bool line =
+        ((stat.data & 0x04) && stat.is_interrupt_enabled(STAT::LYCInterrupt)) ||
+        (mode == STAT::HBlank &&
+         stat.is_interrupt_enabled(STAT::Mode0Interrupt)) ||
+        (mode == STAT::VBlank &&
+         stat.is_interrupt_enabled(STAT::Mode1Interrupt)) ||
+        (mode == STAT::OAMSearch &&
+         stat.is_interrupt_enabled(STAT::Mode2Interrupt));
+    if (line && !stat_line)
+      interrupts |= StatInterrupt;
+    stat_line = line;
+  }
+
+  // Mode 3 runs 172 dots plus the pixels discarded for fine scroll, a
+  // restart for the window and a fetch per sprite. The sprite cost
+  // follows the Pan Docs estimate of 6 to 11 dots each; sprites parked
+  // off the sides are never fetched and cost nothing.
+  int get_transfer_cycles() {
+    int cycles = 172 + (scx & 7);
+    if (window_on_line())
+      cycles += 6;
+    if (lcdc.is_bit_set(LCDC::OBJDisplay)) {
+      sprites.refresh(oam_ram, lcdc.get_sprite_height());
+      for (int n = 0; n < sprites.line_count[ly]; n++) {
+        int x = sprites.x[sprites.line_sprites[ly][n]];
+        if (x == 0 || x >= SCREEN_WIDTH + 8)
+          continue;
+        int fine = (x + scx) & 7;
+        cycles += 6 + (fine < 5 ? 5 - fine : 0);
+      }
+    }
+    return cycles;
+  }
+
+  static uint32_t to_rgba(Color c) {
+    return c.r | (c.g << 8) | (c.b << 16) | 0xFF000000u;
+  }
+
+  // Colour `index` (palette * 4 + colour) of a palette RAM as a pixel
+  uint32_t palette_pixel(const uint8_t *ram, int index) const {
+    if (color_lut)
+      return color_lut[(ram[index * 2] | (ram[index * 2 + 1] << 8)) & 0x7FFF];
+    return to_rgba(get_color_from_ram(ram, index / 4, index % 4));
+  }
+
+  // Packs the row `fine_y` of the tile at tile map offset `map` into
+  // eight pixels at `dest`, applying the tile's CGB attributes.
+  void fetch_tile_row(uint16_t map, int fine_y, uint8_t *dest) const {
+    uint8_t tile = vram[0][map];
+    uint8_t attr = vram[1][map];
+    int row = (attr & 0x40) ? 7 - fine_y : fine_y;
+    int index = (lcdc.get_tile_data_addr(tile) - 0x8000) / 16;
+    uint64_t pixels =
+        tile_cache.row((attr >> 3) & 1, index, row, attr & 0x20);
+    uint64_t bits = ((attr & 0x07) << 2) | (attr & 0x80);
+    pixels |= bits * 0x0101010101010101ull;
+    std::memcpy(dest, &pixels, 8);
+  }
+
+  // Fills 21 tiles of background and returns where pixel 0 of the line
+  // landed, after the fine scroll
+  uint8_t *render_bg_line(uint8_t *line) const {
+    uint8_t y = scy + ly;
+    uint16_t map = lcdc.get_bg_tile_map_addr() - 0x8000 + (y / 8) * 32;
+    int tile_x = scx / 8;
+    for (int t = 0; t < SCREEN_WIDTH / 8 + 1; t++)
+      fetch_tile_row(map + ((tile_x + t) & 31), y & 7, &line[8 + t * 8]);
+    return &line[8 + (scx & 7)];
+  }
+
+  // Lines are compared by hash rather than against a copy of the last
+  // frame. A collision would leave the line stale until it next changes,
+  // which at 64 bits isn't worth a second copy of the framebuffer.
+  void mark_line(int y, const uint32_t *out) {
+    uint64_t hash = 0;
+    for (int x = 0; x < SCREEN_WIDTH; x += 2) {
+      uint64_t pixels;
+      std::memcpy(&pixels, &out[x], 8);
+      hash = (hash ^ pixels) * 0x9E3779B97F4A7C15ull;
+    }
+    hash ^= hash >> 32;
+    if (hash != line_hash[y]) {
+      line_hash[y] = hash;
+      line_dirty[y] = true;
+    }
+    line_drawn[y] = true;
+  }
+
+  bool window_on_line() const {
+    return lcdc.is_bit_set(LCDC::WindowEnable) && ly >= wy && wx <= 166;
+  }
+
+  void render_window_line(uint8_t *bg) {
+    if (!window_on_line())
+      return;
+    int start = get_window_x_screen_pos();
+    uint16_t map =
+        lcdc.get_window_map_start() - 0x8000 + (window_line / 8) * 32;
+    for (int t = 0; start + t * 8 < SCREEN_WIDTH; t++)
+      fetch_tile_row(map + t, window_line & 7, &bg[start + t * 8]);
+    window_line++;
+  }
+
+  // The line's sprites come from the SpriteTable buckets. On CGB the
+  // lower OAM index wins where sprites overlap, so each pixel keeps the
+  // first opaque sprite written to it.
+  void render_sprite_line(uint8_t *obj) {
+    std::memset(obj, 0, SCREEN_WIDTH);
+    if (!lcdc.is_bit_set(LCDC::OBJDisplay))
+      return;
+    int height = lcdc.get_sprite_height();
+    sprites.refresh(oam_ram, height);
+    for (int n = 0; n < sprites.line_count[ly]; n++) {
+      int i = sprites.line_sprites[ly][n];
+      if (sprites.x[i] == 0 || sprites.x[i] >= SCREEN_WIDTH + 8)
+        continue; // Off screen, but still counts towards the 10
+      uint8_t flags = sprites.flags[i];
+      int row = ly + 16 - sprites.y[i];
+      if (flags & 0x40) // Y flip
+        row = height - 1 - row;
+      uint8_t tile = sprites.tile[i];
+      if (height == 16)
+        tile &= 0xFE;
+      // Row 8-15 of a tall sprite is the next tile
+      uint64_t pixels =
+          tile_cache.row((flags >> 3) & 1, tile + row / 8, row % 8,
+                         flags & 0x20);
+      uint8_t attr = 0x40 | ((flags & 0x07) << 2) | (flags & 0x80);
+
+      int x = sprites.x[i] - 8;
+      for (int p = 0; p < 8; p++, pixels >>= 8) {
+        int sx = x + p;
+        uint8_t color = pixels & 0x03;
+        if (color == 0 || sx < 0 || sx >= SCREEN_WIDTH || obj[sx])
+          continue;
+        obj[sx] = attr | color;
+      }
+    }
+  }
+
   Color get_color_from_ram(const uint8_t *ram, uint8_t palette_num,
                            uint8_t color_num) const {
     int index = (palette_num * 8) + (color_num * 2);
@@ -0,0 +1,495 @@
+// Benchmarks for the video side, printed as JSON like AudioBench:
+//
+//  - Upscaler::run() per frame for a set of chains, with the scalar
+//    kernels and with the ones picked for this CPU
+//  - Emulating frames with the inline renderer and with a RenderPipeline
+//  - Recording emulated frames and APU output with a CaptureWriter
+//
+// All are checked as well as timed: every chain must give the same
+// frames with the SIMD kernels as with the scalar ones, the pipeline the
+// same frames as the inline renderer, and the capture files must be the
+// size its counters say. A failed check is reported and makes the exit
+// status 2.
+//
+// Usage: VideoBench [options]
+//   -o FILE           Write the JSON here instead of stdout
+//   --frames N        Frames per measurement (default 300)
+//   --repeat N        Runs per measurement, the fastest one is kept
+//                     (default 5)
+//   --chain SPEC      Only time this chain (see upscale.cpp)
+//   --capture PREFIX  Keep the capture as PREFIX.y4m and PREFIX.wav
+//                     rather than deleting it
+
+#include "audio.cpp"
+#include "capture.cpp"
+#include "upscale.cpp"
+#include "video.cpp"
+#include "video_pipeline.cpp"
+#include <chrono>
+#include <cstdio>
+#include <sys/stat.h>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct BenchResult {
+  std::string chain;
+  const char *kernels;
+  int width, height;
+  double ms_per_frame;
+  bool matches_scalar;
+};
+
+struct PipelineResult {
+  int frames;
+  int mismatched; // Frames the pipeline drew differently
+  uint64_t dropped; // In the timed runs, which wait rather than drop
+  double inline_ms, pipeline_ms; // Per frame, pipeline's per frame drawn
+};
+
+struct CaptureResult {
+  int frames;
+  uint64_t written, repeated, replaced, dropped;
+  uint64_t samples_written, samples_dropped;
+  bool sizes_ok; // Counters add up and match the files
+  double ms;     // Per frame, pushing only
+};
+
+uint32_t next_random(uint32_t &seed) {
+  seed = seed * 1664525 + 1013904223;
+  return seed >> 8;
+}
+
+// Pseudo-random tiles, half of them blank, so the Scale2x/3x kernels
+// see a mix of flat areas and edges, and some sprites
+void fill_lcd(LCD &lcd) {
+  uint32_t seed = 12345;
+  for (int i = 0; i < 0x1800; i++)
+    lcd.vram[0][i] = (i / 16) % 2 ? uint8_t(next_random(seed) >> 16) : 0;
+  for (int i = 0x1800; i < 0x2000; i++)
+    lcd.vram[0][i] = (next_random(seed) >> 16) % 64;
+  for (int i = 0; i < 64; i++) {
+    lcd.bg_palette_ram[i] = uint8_t(next_random(seed) >> 16);
+    lcd.obj_palette_ram[i] = uint8_t(next_random(seed) >> 16);
+  }
+  for (int i = 0; i < 160; i++)
+    lcd.oam_ram[i] = uint8_t(next_random(seed) >> 16);
+  lcd.sprites.invalidate();
+  lcd.refresh_palettes();
+  lcd.write_lcdc(0x93);
+}
+
+// A few LCD frames to scale
+std::vector<std::vector<uint32_t>> bench_frames() {
+  std::unique_ptr<LCD> lcd(new LCD());
+  fill_lcd(*lcd);
+
+  std::vector<std::vector<uint32_t>> frames;
+  for (int f = 0; f < 4; f++) {
+    lcd->scx = f * 3;
+    lcd->scy = f * 5;
+    uint64_t frame = lcd->frame_count;
+    while (lcd->frame_count == frame)
+      lcd->tick(lcd->next_event());
+    const uint32_t *pixels = lcd->framebuffer;
+    frames.emplace_back(pixels,
+                        pixels + LCD::SCREEN_WIDTH * LCD::SCREEN_HEIGHT);
+  }
+  return frames;
+}
+
+// Emulates one frame of what a game might do between V-Blanks: scroll
+// and window moves, LCDC, palette, OAM and VRAM writes, and a colour
+// LUT switch at line 70, all in the middle of lines. The same seed
+// gives the same writes.
+void emulate_frame(LCD &lcd, uint32_t &seed) {
+  uint64_t frame = lcd.frame_count;
+  bool switched = false;
+  while (lcd.frame_count == frame) {
+    lcd.tick(1 + next_random(seed) % 300);
+    uint32_t r = next_random(seed);
+    uint8_t v = uint8_t(r);
+    if (!switched && lcd.ly >= 70 && lcd.ly < LCD::SCREEN_HEIGHT) {
+      lcd.set_color_lut(frame % 2 ? LCD::gbc_color_lut() : nullptr);
+      switched = true;
+    }
+    switch ((r >> 8) % 32) {
+    case 0:
+      lcd.scx = v;
+      break;
+    case 1:
+      lcd.scy = v;
+      break;
+    case 2:
+      lcd.wx = v % 180;
+      break;
+    case 3:
+      lcd.wy = v % 150;
+      break;
+    case 4:
+      lcd.write_lcdc(v | 0x80);
+      break;
+    case 5:
+      lcd.write_bgpi(v);
+      lcd.write_bgpd(uint8_t(r >> 16));
+      break;
+    case 6:
+      lcd.write_obpi(v);
+      lcd.write_obpd(uint8_t(r >> 16));
+      break;
+    case 7:
+      lcd.write_oam(0xFE00 + v % 160, uint8_t(r >> 16));
+      break;
+    case 8:
+      lcd.write_vbk(v);
+      break;
+    default:
+      lcd.write_vram(0x8000 + (r >> 13) % 0x2000, v);
+      break;
+    }
+  }
+}
+
+// The same frames inline and through a RenderPipeline: first one at a
+// time, comparing every frame and its changed lines, then timed
+PipelineResult bench_pipeline(int frames, int repeat) {
+  PipelineResult result = {frames, 0, 0, 0.0, 0.0};
+  std::unique_ptr<LCD> inline_lcd(new LCD()), core(new LCD());
+  std::unique_ptr<FrameExchange> exchange(new FrameExchange());
+  fill_lcd(*inline_lcd);
+  fill_lcd(*core);
+  uint32_t inline_seed = 1, core_seed = 1;
+  {
+    RenderPipeline pipeline(*core, *exchange);
+    std::vector<uint32_t> last(LCD::SCREEN_WIDTH * LCD::SCREEN_HEIGHT);
+    for (int f = 0; f < frames; f++) {
+      emulate_frame(*inline_lcd, inline_seed);
+      emulate_frame(*core, core_seed);
+      pipeline.end_frame();
+      pipeline.flush();
+      exchange->acquire();
+      FrameExchange::Frame frame = exchange->current();
+      bool same = !std::memcmp(frame.pixels, inline_lcd->framebuffer,
+                               sizeof(inline_lcd->framebuffer));
+      for (int y = 0; y < LCD::SCREEN_HEIGHT; y++) {
+        const uint32_t *row = &frame.pixels[y * LCD::SCREEN_WIDTH];
+        if (!frame.changed[y] &&
+            std::memcmp(row, &last[y * LCD::SCREEN_WIDTH],
+                        LCD::SCREEN_WIDTH * sizeof(uint32_t)))
+          same = false; // Changed but not flagged
+      }
+      std::memcpy(last.data(), frame.pixels, last.size() * sizeof(uint32_t));
+      result.mismatched += !same;
+    }
+  }
+
+  for (int r = 0; r < repeat; r++) {
+    auto start = std::chrono::steady_clock::now();
+    for (int f = 0; f < frames; f++)
+      emulate_frame(*inline_lcd, inline_seed);
+    auto end = std::chrono::steady_clock::now();
+    double ms = std::chrono::duration<double, std::milli>(end - start).count();
+    if (r == 0 || ms < result.inline_ms)
+      result.inline_ms = ms;
+
+    // Emulating is far cheaper here than drawing, so the core waits for
+    // the worker instead of dropping, and every frame timed is drawn
+    RenderPipeline pipeline(*core, *exchange);
+    start = std::chrono::steady_clock::now();
+    for (int f = 0; f < frames; f++) {
+      emulate_frame(*core, core_seed);
+      while (pipeline.busy())
+        std::this_thread::yield();
+      pipeline.end_frame();
+    }
+    pipeline.flush();
+    end = std::chrono::steady_clock::now();
+    ms = std::chrono::duration<double, std::milli>(end - start).count();
+    uint64_t drawn = pipeline.frames_drawn();
+    ms /= drawn ? drawn : 1;
+    result.dropped += pipeline.frames_dropped();
+    if (r == 0 || ms < result.pipeline_ms)
+      result.pipeline_ms = ms;
+  }
+  result.inline_ms /= frames;
+  return result;
+}
+
+// Runs a chain with the scalar kernels and with `kernels` over the same
+// frames, a few times round so ghosting has a history, comparing every
+// output
+bool matches_scalar(const std::string &chain, const UpscaleKernels *kernels,
+                    const std::vector<std::vector<uint32_t>> &frames) {
+  std::unique_ptr<Upscaler> scalar(new Upscaler()), simd(new Upscaler());
+  scalar->kernels = &UpscaleKernels::scalar();
+  simd->kernels = kernels;
+  scalar->configure(chain, LCD::SCREEN_WIDTH, LCD::SCREEN_HEIGHT);
+  simd->configure(chain, LCD::SCREEN_WIDTH, LCD::SCREEN_HEIGHT);
+  std::size_t size = std::size_t(scalar->out_width) * scalar->out_height;
+  for (std::size_t i = 0; i < frames.size() * 3; i++) {
+    const uint32_t *a = scalar->run(frames[i % frames.size()].data());
+    const uint32_t *b = simd->run(frames[i % frames.size()].data());
+    if (std::memcmp(a, b, size * sizeof(uint32_t)))
+      return false;
+  }
+  return true;
+}
+
+long file_size(const char *path) {
+  struct stat info;
+  return stat(path, &info) == 0 ? long(info.st_size) : -1;
+}
+
+// Records emulated frames, through a FrameExchange as in the frontend,
+// and a note from the APU with a CaptureWriter, as fast as they come.
+// The writer may well fall behind; whatever it did, every frame pushed
+// must be written or counted as dropped, and so must every sample, and
+// the files must hold exactly what was written.
+CaptureResult bench_capture(int frames, const char *prefix) {
+  const int APU_RATE = APU::CLOCK_RATE / 64; // Whole cycles per sample
+  CaptureResult result = {frames, 0, 0, 0, 0, 0, 0, false, 0.0};
+  std::string base = prefix ? prefix : "videobench_capture";
+  std::string video_path = base + ".y4m", audio_path = base + ".wav";
+
+  std::unique_ptr<CaptureWriter> capture(new CaptureWriter());
+  if (!capture->open(video_path.c_str(), CaptureWriter::Y4M,
+                     audio_path.c_str(), APU_RATE)) {
+    std::fprintf(stderr, "%s\n", capture->error.c_str());
+    return result;
+  }
+
+  std::unique_ptr<LCD> lcd(new LCD());
+  std::unique_ptr<FrameExchange> exchange(new FrameExchange());
+  std::unique_ptr<APU> apu(new APU());
+  fill_lcd(*lcd);
+  exchange->attach(*lcd);
+  apu->set_sample_rate(APU_RATE);
+  apu->write_byte(0xFF26, 0x80); // Power on, both sides, full volume
+  apu->write_byte(0xFF25, 0x11);
+  apu->write_byte(0xFF24, 0x77);
+  apu->write_byte(0xFF12, 0xF0); // Channel 1 at volume 15, no envelope
+  apu->write_byte(0xFF13, 0x00);
+  apu->write_byte(0xFF14, 0x87);
+
+  std::vector<int16_t> samples(2 * (LCD::CYCLES_PER_FRAME / 64 + 1));
+  uint32_t seed = 1;
+  uint64_t samples_pushed = 0;
+  double ms = 0.0;
+  for (int f = 0; f < frames; f++) {
+    emulate_frame(*lcd, seed);
+    exchange->present(*lcd);
+    exchange->acquire();
+    FrameExchange::Frame frame = exchange->current();
+    bool changed = false;
+    for (int y = 0; y < LCD::SCREEN_HEIGHT; y++)
+      changed |= frame.changed[y];
+    // Samples up to the end of this frame, at whole cycles per sample
+    std::size_t count =
+        std::size_t((uint64_t(f + 1) * LCD::CYCLES_PER_FRAME / 64) -
+                    samples_pushed);
+    apu->render_s16(samples.data(), count);
+
+    auto start = std::chrono::steady_clock::now();
+    capture->push_frame(frame.pixels, changed);
+    capture->push_samples(samples.data(), count);
+    auto end = std::chrono::steady_clock::now();
+    ms += std::chrono::duration<double, std::milli>(end - start).count();
+    samples_pushed += count;
+  }
+  capture->close();
+
+  result.written = capture->frames_written;
+  result.repeated = capture->frames_repeated;
+  result.replaced = capture->frames_replaced;
+  result.dropped = capture->frames_dropped;
+  result.samples_written = capture->samples_written;
+  result.samples_dropped = capture->samples_dropped;
+  result.ms = ms / frames;
+
+  const long Y4M_HEADER = long(std::strlen(CaptureWriter::Y4M_HEADER));
+  const long Y4M_FRAME = 6 + LCD::SCREEN_WIDTH * LCD::SCREEN_HEIGHT * 3;
+  const long WAV_HEADER = 44;
+  result.sizes_ok =
+      result.written + result.dropped == uint64_t(frames) &&
+      result.samples_written + result.samples_dropped == samples_pushed &&
+      file_size(video_path.c_str()) ==
+          Y4M_HEADER + long(result.written) * Y4M_FRAME &&
+      file_size(audio_path.c_str()) ==
+          WAV_HEADER + long(result.samples_written) * 4;
+  if (!prefix) {
+    std::remove(video_path.c_str());
+    std::remove(audio_path.c_str());
+  }
+  return result;
+}
+
+volatile uint32_t bench_sink; // Keeps the output from being optimized out
+
+double run_once(Upscaler &upscaler,
+                const std::vector<std::vector<uint32_t>> &frames, int count) {
+  uint32_t sum = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < count; i++) {
+    const uint32_t *out = upscaler.run(frames[i % frames.size()].data());
+    sum += out[(i * 7919) % (upscaler.out_width * upscaler.out_height)];
+  }
+  auto end = std::chrono::steady_clock::now();
+  bench_sink = sum;
+  return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+void write_json(std::FILE *out, const std::vector<BenchResult> &results,
+                const PipelineResult &pipeline, const CaptureResult &capture,
+                int frames, int repeat) {
+  std::fprintf(out, "{\n");
+  std::fprintf(out, "  \"benchmark\": \"upscaler_run\",\n");
+  std::fprintf(out, "  \"frames\": %d,\n", frames);
+  std::fprintf(out, "  \"repeat\": %d,\n", repeat);
+  std::fprintf(out,
+               "  \"pipeline\": {\"mismatched_frames\": %d, "
+               "\"dropped_frames\": %llu, \"inline_ms_per_frame\": %.4f, "
+               "\"pipeline_ms_per_frame\": %.4f},\n",
+               pipeline.mismatched, (unsigned long long)pipeline.dropped,
+               pipeline.inline_ms, pipeline.pipeline_ms);
+  std::fprintf(out,
+               "  \"capture\": {\"sizes_ok\": %s, \"frames_written\": %llu, "
+               "\"frames_repeated\": %llu, \"frames_replaced\": %llu, "
+               "\"frames_dropped\": %llu, \"samples_written\": %llu, "
+               "\"samples_dropped\": %llu, \"push_ms_per_frame\": %.4f},\n",
+               capture.sizes_ok ? "true" : "false",
+               (unsigned long long)capture.written,
+               (unsigned long long)capture.repeated,
+               (unsigned long long)capture.replaced,
+               (unsigned long long)capture.dropped,
+               (unsigned long long)capture.samples_written,
+               (unsigned long long)capture.samples_dropped, capture.ms);
+  std::fprintf(out, "  \"results\": [");
+  for (std::size_t i = 0; i < results.size(); i++) {
+    const BenchResult &r = results[i];
+    std::fprintf(out,
+                 "%s\n    {\"chain\": \"%s\", \"kernels\": \"%s\", "
+                 "\"width\": %d, \"height\": %d, \"ms_per_frame\": %.4f, "
+                 "\"matches_scalar\": %s}",
+                 i ? "," : "", r.chain.c_str(), r.kernels, r.width, r.height,
+                 r.ms_per_frame, r.matches_scalar ? "true" : "false");
+  }
+  std::fprintf(out, "\n  ]\n}\n");
+}
+
+int main(int argc, char **argv) {
+  const char *output = nullptr;
+  const char *only = nullptr;
+  const char *capture_prefix = nullptr;
+  int frames = 300;
+  int repeat = 5;
+
+  for (int i = 1; i < argc; i++) {
+    bool has_value = i + 1 < argc;
+    if (!std::strcmp(argv[i], "-o") && has_value)
+      output = argv[++i];
+    else if (!std::strcmp(argv[i], "--frames") && has_value)
+      frames = std::atoi(argv[++i]);
+    else if (!std::strcmp(argv[i], "--repeat") && has_value)
+      repeat = std::atoi(argv[++i]);
+    else if (!std::strcmp(argv[i], "--chain") && has_value)
+      only = argv[++i];
+    else if (!std::strcmp(argv[i], "--capture") && has_value)
+      capture_prefix = argv[++i];
+    else {
+      std::fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      return 1;
+    }
+  }
+  if (frames <= 0 || repeat <= 0) {
+    std::fprintf(stderr, "Invalid --frames or --repeat\n");
+    return 1;
+  }
+
+  std::vector<std::string> chains = {
+      "int2",         "int3",          "int4",
+      "int5",         "int6",          "scale2x",
+      "scale3x",      "ghost",         "int4,grid",
+      "scale3x,grid", "scale2x,int2",  "ghost,scale2x,int2,grid"};
+  if (only)
+    chains = {only};
+
+  std::vector<std::vector<uint32_t>> input = bench_frames();
+  std::vector<const UpscaleKernels *> kernel_sets = {
+      &UpscaleKernels::scalar()};
+  if (std::strcmp(UpscaleKernels::get().name, "scalar") != 0)
+    kernel_sets.push_back(&UpscaleKernels::get()); // SIMD on this CPU
+  std::vector<BenchResult> results;
+  bool simd_ok = true;
+
+  for (const std::string &chain : chains) {
+    for (const UpscaleKernels *kernels : kernel_sets) {
+      std::unique_ptr<Upscaler> upscaler(new Upscaler());
+      upscaler->kernels = kernels;
+      if (!upscaler->configure(chain, LCD::SCREEN_WIDTH,
+                               LCD::SCREEN_HEIGHT)) {
+        std::fprintf(stderr, "%s\n", upscaler->error.c_str());
+        return 1;
+      }
+      bool matches = matches_scalar(chain, kernels, input);
+      if (!matches) {
+        std::fprintf(stderr, "%s: %s output differs from scalar\n",
+                     chain.c_str(), kernels->name);
+        simd_ok = false;
+      }
+      run_once(*upscaler, input, frames / 10 + 1); // Warm up
+      double best = 0.0;
+      for (int r = 0; r < repeat; r++) {
+        double ms = run_once(*upscaler, input, frames);
+        if (r == 0 || ms < best)
+          best = ms;
+      }
+      results.push_back({chain, kernels->name, upscaler->out_width,
+                         upscaler->out_height, best / frames, matches});
+      std::fprintf(stderr, "%-26s %-6s %4dx%-4d %8.4f ms/frame\n",
+                   chain.c_str(), kernels->name, upscaler->out_width,
+                   upscaler->out_height, best / frames);
+    }
+  }
+
+  PipelineResult pipeline = bench_pipeline(frames, repeat);
+  std::fprintf(stderr,
+               "pipeline: %d/%d frames mismatched, %llu dropped, inline "
+               "%.4f ms/frame, pipeline %.4f ms/frame\n",
+               pipeline.mismatched, frames,
+               (unsigned long long)pipeline.dropped, pipeline.inline_ms,
+               pipeline.pipeline_ms);
+  if (pipeline.dropped)
+    std::fprintf(stderr, "pipeline: dropped frames while paced, timing is "
+                         "not per frame drawn\n");
+
+  CaptureResult capture = bench_capture(frames, capture_prefix);
+  std::fprintf(stderr,
+               "capture: %llu/%d frames written (%llu repeated, %llu "
+               "replaced, %llu dropped), %llu samples (%llu dropped), "
+               "sizes %s, %.4f ms/frame pushing\n",
+               (unsigned long long)capture.written, frames,
+               (unsigned long long)capture.repeated,
+               (unsigned long long)capture.replaced,
+               (unsigned long long)capture.dropped,
+               (unsigned long long)capture.samples_written,
+               (unsigned long long)capture.samples_dropped,
+               capture.sizes_ok ? "match" : "DON'T match", capture.ms);
+
+  std::FILE *out = stdout;
+  if (output) {
+    out = std::fopen(output, "w");
+    if (!out) {
+      std::fprintf(stderr, "Can't write %s\n", output);
+      return 1;
+    }
+  }
+  write_json(out, results, pipeline, capture, frames, repeat);
+  if (out != stdout)
+    std::fclose(out);
+  bool ok = simd_ok && !pipeline.mismatched && !pipeline.dropped &&
+            capture.sizes_ok;
+  return ok ? 0 : 2;
+}
@@ -0,0 +1,187 @@
+// Renders the LCD's frames on a worker thread. The emulated LCD records
+// a FrameLog instead of drawing (registers per line, memory writes in
+// between), and at V-Blank the log goes to the worker, which replays it
+// on a shadow LCD and draws frame N while the core emulates frame N+1.
+// The pixels come out the same as from the inline renderer.
+//
+// Logs go back and forth through SpscRings, so the core never waits for
+// the worker. When the worker is so far behind that it holds every other
+// log, the frame just logged is dropped: its lines are thrown away but
+// its writes stay in the log, ahead of the next frame's, so the shadow's
+// memory still ends up exact and the next frame drawn is right.
+//
+// An idle worker sleeps on a condition variable. It only holds the mutex
+// while checking the queue, and the core only takes it to wake a worker
+// that has said it is asleep.
+//
+// Finished frames go out through a FrameExchange, with the worker as its
+// producer, so the frontend reads them as it would from the LCD itself.
+#pragma once
+
+#include "frame_exchange.cpp"
+#include "spsc_ring.cpp"
+#include "video.cpp"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+class RenderPipeline {
+public:
+  // Copies the LCD's memory to the shadow and starts logging. Both must
+  // outlive the pipeline, which becomes the exchange's only producer.
+  RenderPipeline(LCD &lcd, FrameExchange &exchange)
+      : core(lcd), frames(exchange), shadow(new LCD()) {
+    copy_memory();
+    frames.attach(*shadow);
+    filling = 0;
+    logs[0].clear();
+    core.frame_log = &logs[0];
+    for (int i = 1; i < LOG_SLOTS; i++)
+      free_logs.push(i);
+    worker = std::thread([this] { run(); });
+  }
+
+  ~RenderPipeline() {
+    {
+      std::lock_guard<std::mutex> lock(wake_mutex);
+      quit.store(true, std::memory_order_release);
+    }
+    wake.notify_one();
+    worker.join();
+    core.frame_log = nullptr;
+  }
+
+  // Hands the frame logged so far to the worker and starts logging the
+  // next one. Call on V-Blank. Never waits for the worker: with no free
+  // log the frame is dropped, as described at the top.
+  void end_frame() {
+    int next;
+    if (!free_logs.pop(next)) {
+      logs[filling].lines.clear();
+      dropped_count++;
+      return;
+    }
+    queued.push(filling); // Can't fail, there are only LOG_SLOTS logs
+    handed_count++;
+    // Pairs with the fence in run(): either the worker sees the log or
+    // we see it waiting
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping.load(std::memory_order_relaxed)) {
+      std::lock_guard<std::mutex> lock(wake_mutex);
+      wake.notify_one();
+    }
+    filling = next;
+    logs[filling].clear();
+    core.frame_log = &logs[filling];
+  }
+
+  // Waits until every frame handed over has been drawn
+  void flush() {
+    while (frames_drawn() < handed_count)
+      std::this_thread::yield();
+  }
+
+  // After writing the LCD's memory directly rather than through its
+  // write_* methods, which is all the log sees. Drops what was logged
+  // of the current frame.
+  void resync() {
+    flush();
+    copy_memory();
+    logs[filling].clear();
+  }
+
+  uint64_t frames_drawn() const {
+    return drawn_count.load(std::memory_order_acquire);
+  }
+
+  // Frames dropped by end_frame() because the worker was behind
+  uint64_t frames_dropped() const { return dropped_count; }
+
+  // True while end_frame() would drop the frame, for callers that would
+  // rather wait for the worker
+  bool busy() const { return free_logs.size() == 0; }
+
+private:
+  static constexpr int LOG_SLOTS = 4; // The core's, and three in flight
+
+  LCD &core;
+  FrameExchange &frames;
+  std::unique_ptr<LCD> shadow; // Only the worker touches it once running
+  FrameLog logs[LOG_SLOTS];
+  int filling; // Log the core writes to
+  SpscRing<int, LOG_SLOTS> queued;    // Core to worker, to be drawn
+  SpscRing<int, LOG_SLOTS> free_logs; // Worker to core, drawn
+  uint64_t handed_count = 0;          // Core only
+  uint64_t dropped_count = 0;         // Core only
+  std::atomic<uint64_t> drawn_count{0};
+
+  std::atomic<bool> quit{false};
+  std::atomic<bool> sleeping{false}; // Worker is about to wait or waiting
+  std::mutex wake_mutex;
+  std::condition_variable wake;
+  std::thread worker;
+
+  void copy_memory() {
+    std::memcpy(shadow->vram, core.vram, sizeof(core.vram));
+    std::memcpy(shadow->oam_ram, core.oam_ram, sizeof(core.oam_ram));
+    std::memcpy(shadow->bg_palette_ram, core.bg_palette_ram,
+                sizeof(core.bg_palette_ram));
+    std::memcpy(shadow->obj_palette_ram, core.obj_palette_ram,
+                sizeof(core.obj_palette_ram));
+    shadow->tile_cache.invalidate_all();
+    shadow->sprites.invalidate();
+    shadow->set_color_lut(core.color_lut);
+  }
+
+  // Sleeps whenever the queue is empty, until end_frame() or the
+  // destructor wakes it
+  void run() {
+    while (!quit.load(std::memory_order_acquire)) {
+      int index;
+      if (!queued.pop(index)) {
+        std::unique_lock<std::mutex> lock(wake_mutex);
+        sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        wake.wait(lock, [this] {
+          return queued.size() != 0 || quit.load(std::memory_order_acquire);
+        });
+        sleeping.store(false, std::memory_order_relaxed);
+        continue;
+      }
+      draw(logs[index]);
+      free_logs.push(index);
+    }
+  }
+
+  // Replays a frame into the exchange's back buffer and publishes it
+  void draw(const FrameLog &log) {
+    std::size_t w = 0;
+    for (const FrameLog::Line &line : log.lines) {
+      for (; w < line.first_write; w++)
+        apply(log.writes[w]);
+      if (shadow->color_lut != line.color_lut)
+        shadow->set_color_lut(line.color_lut);
+      shadow->ly = line.ly;
+      shadow->lcdc.data = line.lcdc;
+      shadow->scx = line.scx;
+      shadow->scy = line.scy;
+      shadow->wx = line.wx;
+      shadow->wy = line.wy;
+      shadow->window_line = line.window_line;
+      shadow->render_scanline();
+    }
+    for (; w < log.writes.size(); w++)
+      apply(log.writes[w]);
+
+    frames.present(*shadow);
+    drawn_count.fetch_add(1, std::memory_order_release);
+  }
+
+  void apply(const FrameLog::Write &write) {
+    shadow->poke(FrameLog::Target(write.target), write.offset, write.value);
+  }
+};
@@ -0,0 +1,130 @@
+// Minimal RIFF/WAVE file writer for rendered audio.
+// Samples come in as interleaved floats in [-1, 1] or int16 and are stored
+// as 16-bit PCM or 32-bit IEEE float. The header sizes are patched on close.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+class WavWriter {
+public:
+  enum Format { PCM16, Float32 };
+
+  WavWriter() {
+    file = nullptr;
+    format = PCM16;
+    channels = 2;
+    data_bytes = 0;
+  }
+
+  ~WavWriter() { close(); }
+
+  bool open(const char *path, int sample_rate, int num_channels,
+            Format sample_format) {
+    close();
+    file = std::fopen(path, "wb");
+    if (!file)
+      return false;
+    format = sample_format;
+    channels = num_channels;
+    data_bytes = 0;
+
+    int bytes_per_sample = (format == PCM16) ? 2 : 4;
+    write_tag("RIFF");
+    write_u32(0); // Patched in close()
+    write_tag("WAVE");
+    write_tag("fmt ");
+    write_u32(16);
+    write_u16(format == PCM16 ? 1 : 3); // PCM or IEEE float
+    write_u16(channels);
+    write_u32(sample_rate);
+    write_u32(sample_rate * channels * bytes_per_sample);
+    write_u16(channels * bytes_per_sample);
+    write_u16(bytes_per_sample * 8);
+    write_tag("data");
+    write_u32(0); // Patched in close()
+    return true;
+  }
+
+  bool is_open() const { return file != nullptr; }
+
+  // Writes `frames` interleaved frames
+  void write(const float *samples, std::size_t frames) {
+    if (!file)
+      return;
+    std::size_t count = frames * channels;
+    if (format == Float32) {
+      data_bytes += std::fwrite(samples, 4, count, file) * 4;
+      return;
+    }
+
+    int16_t block[1024];
+    while (count > 0) {
+      std::size_t n = count < 1024 ? count : 1024;
+      for (std::size_t i = 0; i < n; i++) {
+        float s = samples[i];
+        if (s > 1.0f)
+          s = 1.0f;
+        if (s < -1.0f)
+          s = -1.0f;
+        block[i] = static_cast<int16_t>(s * 32767.0f);
+      }
+      data_bytes += std::fwrite(block, 2, n, file) * 2;
+      samples += n;
+      count -= n;
+    }
+  }
+
+  // Writes `frames` interleaved int16 frames
+  void write(const int16_t *samples, std::size_t frames) {
+    if (!file)
+      return;
+    std::size_t count = frames * channels;
+    if (format == PCM16) {
+      data_bytes += std::fwrite(samples, 2, count, file) * 2;
+      return;
+    }
+
+    float block[1024];
+    while (count > 0) {
+      std::size_t n = count < 1024 ? count : 1024;
+      for (std::size_t i = 0; i < n; i++)
+        block[i] = samples[i] * (1.0f / 32768.0f);
+      data_bytes += std::fwrite(block, 4, n, file) * 4;
+      samples += n;
+      count -= n;
+    }
+  }
+
+  void close() {
+    if (!file)
+      return;
+    std::fseek(file, 4, SEEK_SET);
+    write_u32(36 + data_bytes);
+    std::fseek(file, 40, SEEK_SET);
+    write_u32(data_bytes);
+    std::fclose(file);
+    file = nullptr;
+  }
+
+private:
+  std::FILE *file;
+  Format format;
+  int channels;
+  uint32_t data_bytes;
+
+  void write_tag(const char *tag) { std::fwrite(tag, 1, 4, file); }
+
+  // WAV is little endian whatever the host is
+  void write_u16(uint16_t v) {
+    uint8_t b[2] = {uint8_t(v), uint8_t(v >> 8)};
+    std::fwrite(b, 1, 2, file);
+  }
+
+  void write_u32(uint32_t v) {
+    uint8_t b[4] = {uint8_t(v), uint8_t(v >> 8), uint8_t(v >> 16),
+                    uint8_t(v >> 24)};
+    std::fwrite(b, 1, 4, file);
+  }
+};